@@ -0,0 +1,231 @@
+/*
+ * Microbenchmarks del simulador
+ *
+ * Para cada clase de instruccion se arma en memoria un loop cuyo cuerpo
+ * repite BODY_LEN instrucciones de esa clase y se mide go() con
+ * CLOCK_MONOTONIC en cada motor. La salida es CSV por stdout:
+ *
+ *   engine,class,instructions,ns,ns_per_inst,mips
+ *
+ * Uso: sim_bench [iteraciones]
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "shell.h"
+
+#define BODY_LEN     256
+#define DEFAULT_ITER 20000
+
+#define X_BASE  1       // base de loads/stores (MEM_DATA_START)
+#define X_BR    7       // destino de BR
+#define X_COUNT 9       // contador del loop
+
+extern const char *ENGINE_NAMES[];
+void go(sim_context_t *ctx, FILE *dumpsim_file);
+
+/* Codificaciones (variantes de 64 bits) */
+static uint32_t enc_r(uint32_t base, int rd, int rn, int rm)
+{
+    return base | rm << 16 | rn << 5 | rd;
+}
+
+static uint32_t enc_i(uint32_t base, int rd, int rn, int imm12)
+{
+    return base | imm12 << 10 | rn << 5 | rd;
+}
+
+static uint32_t enc_lsl(int rd, int rn, int shift)
+{
+    return 0xD3400000 | ((64 - shift) & 0x3F) << 16 | (63 - shift) << 10 | rn << 5 | rd;
+}
+
+static uint32_t enc_lsr(int rd, int rn, int shift)
+{
+    return 0xD340FC00 | shift << 16 | rn << 5 | rd;
+}
+
+static uint32_t enc_d(uint32_t base, int rt, int rn, int imm9)
+{
+    return base | (imm9 & 0x1FF) << 12 | rn << 5 | rt;
+}
+
+static uint32_t enc_bcond(int cond, int offset)
+{
+    return 0x54000000 | ((offset / 4) & 0x7FFFF) << 5 | cond;
+}
+
+static uint32_t enc_movz(int rd, int imm16, int hw)
+{
+    return 0xD2800000 | hw << 21 | imm16 << 5 | rd;
+}
+
+#define ADDS     0xAB000000
+#define SUBS     0xEB000000
+#define ANDS     0xEA000000
+#define EOR      0xCA000000
+#define ORR      0xAA000000
+#define ADDS_IMM 0xB1000000
+#define SUBS_IMM 0xF1000000
+#define STUR     0xF8000000
+#define LDUR     0xF8400000
+#define BR(rn)   (0xD61F0000 | (rn) << 5)
+#define HLT      0xD4400000
+#define COND_NE  0x1
+#define COND_GE  0xA
+#define COND_LT  0xB
+
+/* Instruccion i del cuerpo; at es su direccion */
+typedef uint32_t (*body_fn)(int i, uint64_t at);
+
+static uint32_t body_alu_reg(int i, uint64_t at)
+{
+    static const uint32_t ops[] = { ADDS, SUBS, ANDS, EOR, ORR };
+    return enc_r(ops[i % 5], 2 + i % 4, 2 + (i + 1) % 4, 2 + (i + 2) % 4);
+}
+
+static uint32_t body_alu_imm(int i, uint64_t at)
+{
+    return enc_i(i & 1 ? SUBS_IMM : ADDS_IMM, 2 + i % 4, 2 + i % 4, 1 + i % 7);
+}
+
+static uint32_t body_shift(int i, uint64_t at)
+{
+    return i & 1 ? enc_lsr(2 + i % 4, 2 + (i + 1) % 4, 1 + i % 13)
+                 : enc_lsl(2 + i % 4, 2 + (i + 1) % 4, 1 + i % 13);
+}
+
+static uint32_t body_load(int i, uint64_t at)
+{
+    return enc_d(LDUR, 2 + i % 4, X_BASE, 8 * (i % 32));
+}
+
+static uint32_t body_store(int i, uint64_t at)
+{
+    return enc_d(STUR, 2 + i % 4, X_BASE, 8 * (i % 32));
+}
+
+// El contador es positivo: N == 0 durante todo el cuerpo
+static uint32_t body_bcond_taken(int i, uint64_t at)
+{
+    return enc_bcond(COND_GE, 4);
+}
+
+static uint32_t body_bcond_not_taken(int i, uint64_t at)
+{
+    return enc_bcond(COND_LT, 4);
+}
+
+// Pares "adds X7, X7, #8; br X7": cada BR salta al par siguiente
+static uint32_t body_br(int i, uint64_t at)
+{
+    return i & 1 ? BR(X_BR) : enc_i(ADDS_IMM, X_BR, X_BR, 8);
+}
+
+static const struct {
+    const char *name;
+    body_fn body;
+} CLASSES[] = {
+    { "alu_reg",        body_alu_reg },
+    { "alu_imm",        body_alu_imm },
+    { "shift",          body_shift },
+    { "load",           body_load },
+    { "store",          body_store },
+    { "bcond_taken",    body_bcond_taken },
+    { "bcond_not_taken", body_bcond_not_taken },
+    { "br",             body_br },
+};
+
+#define N_CLASSES (sizeof(CLASSES) / sizeof(CLASSES[0]))
+
+/*
+ * head:  movz X7, #hi(body), lsl 16
+ *        adds X7, X7, #lo(body)
+ * body:  BODY_LEN instrucciones
+ *        subs X9, X9, #1
+ *        b.ne head
+ *        hlt
+ */
+static void load_class(sim_context_t *ctx, body_fn body)
+{
+    uint64_t pc = MEM_TEXT_START;
+    uint64_t start = MEM_TEXT_START + 8;
+    int i;
+
+    mem_write_32(ctx, pc, enc_movz(X_BR, start >> 16, 1)); pc += 4;
+    mem_write_32(ctx, pc, enc_i(ADDS_IMM, X_BR, X_BR, start & 0xFFFF)); pc += 4;
+    for (i = 0; i < BODY_LEN; i++, pc += 4)
+        mem_write_32(ctx, pc, body(i, pc));
+    mem_write_32(ctx, pc, enc_i(SUBS_IMM, X_COUNT, X_COUNT, 1)); pc += 4;
+    mem_write_32(ctx, pc, enc_bcond(COND_NE, MEM_TEXT_START - pc)); pc += 4;
+    mem_write_32(ctx, pc, HLT);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITER;
+    sim_context_t *ctx;
+    int engine, c, i;
+
+    if (iterations <= 0) {
+        printf("Error: usage: %s [iterations]\n", argv[0]);
+        exit(1);
+    }
+    // cada iteracion ejecuta head, cuerpo, subs y b.ne; todo tiene que entrar en el int
+    if (iterations > (INT_MAX - 1) / (BODY_LEN + 4)) {
+        printf("Error: at most %d iterations\n", (INT_MAX - 1) / (BODY_LEN + 4));
+        exit(1);
+    }
+
+    // el progreso de go() se descarta: por stdout sale solo el CSV
+    ctx = sim_context_create();
+    ctx->out = fopen("/dev/null", "w");
+    if (ctx->out == NULL) {
+        fprintf(stderr, "Error: Can't open /dev/null\n");
+        exit(-1);
+    }
+
+    printf( "engine,class,instructions,ns,ns_per_inst,mips\n");
+    for (c = 0; c < N_CLASSES; c++) {
+        load_class(ctx, CLASSES[c].body);
+        for (engine = ENGINE_INTERP; engine <= ENGINE_THREADED; engine++) {
+            uint64_t t0, ns;
+            int count;
+
+            memset(&ctx->CURRENT_STATE, 0, sizeof(ctx->CURRENT_STATE));
+            ctx->CURRENT_STATE.PC = MEM_TEXT_START;
+            ctx->CURRENT_STATE.REGS[X_BASE] = MEM_DATA_START;
+            ctx->CURRENT_STATE.REGS[X_COUNT] = iterations;
+            for (i = 2; i < 6; i++)
+                ctx->CURRENT_STATE.REGS[i] = 0x1234567 * i;
+            ctx->NEXT_STATE = ctx->CURRENT_STATE;
+            ctx->RUN_BIT = TRUE;
+            ctx->ENGINE = engine;
+            // cada corrida cuenta desde 0: acumulado desbordaria el int
+            ctx->INSTRUCTION_COUNT = 0;
+
+            t0 = now_ns();
+            go(ctx, NULL);
+            ns = now_ns() - t0;
+
+            count = ctx->INSTRUCTION_COUNT;
+            printf("%s,%s,%d,%" PRIu64 ",%.3f,%.1f\n", ENGINE_NAMES[engine],
+                    CLASSES[c].name, count, ns, (double) ns / count, count * 1e3 / ns);
+        }
+    }
+
+    fclose(ctx->out);
+    sim_context_destroy(ctx);
+    return 0;
+}
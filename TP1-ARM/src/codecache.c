@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "shell.h"
+#include "sim.h"
+
+/*
+ * Cache de bloques decodificados compartida entre contextos
+ *
+ * Los contextos que corren el mismo programa (mismo hash del texto) usan
+ * los mismos bloques decodificados: el primero que traduce un bloque lo
+ * publica con un CAS sobre la cabeza de su bucket y los demas lo
+ * encuentran sin tomar ningun lock. Un bloque publicado no cambia nunca.
+ * El hash puede chocar: un bloque solo se usa si sus palabras son las que
+ * tiene en memoria quien lo busca.
+ *
+ * Cuando la cache se llena se vacia entera: los buckets se desenganchan,
+ * se incrementa la generacion y los bloques se liberan por epocas. Los
+ * motores solo tocan bloques compartidos entre code_cache_enter() y
+ * code_cache_leave(), y al entrar descartan sus bloques si la generacion
+ * cambio; un bloque retirado en la epoca e se libera cuando la epoca
+ * global llega a e + 2, es decir, cuando todos los hilos activos ya
+ * entraron despues de vaciar la cache.
+ */
+
+#define CODE_CACHE_BUCKETS    (1 << 16)
+#define CODE_CACHE_MAX_BLOCKS (1 << 18)   // se vacia al superar este numero
+
+// Estado de un hilo para la reclamacion por epocas
+typedef struct epoch_thread epoch_thread_t;
+struct epoch_thread {
+    atomic_uint_fast64_t epoch;     // epoca global al entrar
+    atomic_int active;              // entre enter y leave
+    atomic_int in_use;              // registro tomado por un hilo vivo
+    epoch_thread_t *next;
+};
+
+static _Atomic(shared_block_t *) buckets[CODE_CACHE_BUCKETS];
+static atomic_int block_count;
+static atomic_uint generation;
+
+static atomic_uint_fast64_t global_epoch;
+static _Atomic(epoch_thread_t *) threads;
+static __thread epoch_thread_t *self;
+
+// Bloques retirados, por epoca de retiro modulo 3
+static shared_block_t *retired[3];
+static atomic_int retired_pending;
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t bucket_of(uint64_t text_hash, uint64_t start)
+{
+    uint64_t h = (text_hash ^ start) * 0x9E3779B97F4A7C15ULL;
+
+    return h >> (64 - 16);
+}
+
+// Al terminar el hilo su registro queda libre para otro
+static void release_thread(void *rec)
+{
+    atomic_store(&((epoch_thread_t *) rec)->in_use, 0);
+}
+
+static void make_thread_key(void)
+{
+    pthread_key_create(&thread_key, release_thread);
+}
+
+static epoch_thread_t *register_thread(void)
+{
+    epoch_thread_t *t;
+    int free_rec;
+
+    pthread_once(&thread_key_once, make_thread_key);
+    for (t = atomic_load(&threads); t != NULL; t = t->next) {
+        free_rec = 0;
+        if (atomic_compare_exchange_strong(&t->in_use, &free_rec, 1))
+            break;
+    }
+    if (t == NULL) {
+        t = calloc(1, sizeof(epoch_thread_t));
+        assert(t != NULL);
+        atomic_store(&t->in_use, 1);
+        t->next = atomic_load(&threads);
+        while (!atomic_compare_exchange_weak(&threads, &t->next, t))
+            ;
+    }
+    pthread_setspecific(thread_key, t);
+    return t;
+}
+
+static void free_list(shared_block_t *b)
+{
+    shared_block_t *next;
+
+    for (; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+}
+
+/*
+ * Avanza la epoca global si todos los hilos activos ya la vieron y libera
+ * lo retirado dos epocas atras. Con retire_lock tomado.
+ */
+static void try_advance(void)
+{
+    uint_fast64_t e = atomic_load(&global_epoch);
+    epoch_thread_t *t;
+
+    for (t = atomic_load(&threads); t != NULL; t = t->next)
+        if (atomic_load(&t->active) && atomic_load(&t->epoch) != e)
+            return;
+
+    atomic_store(&global_epoch, e + 1);
+    if (retired[(e + 2) % 3] != NULL) {
+        free_list(retired[(e + 2) % 3]);
+        retired[(e + 2) % 3] = NULL;
+        atomic_fetch_sub(&retired_pending, 1);
+    }
+}
+
+void code_cache_enter(void)
+{
+    if (self == NULL)
+        self = register_thread();
+    atomic_store(&self->active, 1);
+    atomic_store(&self->epoch, atomic_load(&global_epoch));
+}
+
+void code_cache_leave(void)
+{
+    atomic_store(&self->active, 0);
+    if (atomic_load(&retired_pending) > 0 && pthread_mutex_trylock(&retire_lock) == 0) {
+        try_advance();
+        pthread_mutex_unlock(&retire_lock);
+    }
+}
+
+unsigned code_cache_generation(void)
+{
+    return atomic_load(&generation);
+}
+
+// El bloque sale de las mismas palabras que hay en la memoria de ctx
+static int same_text(sim_context_t *ctx, const shared_block_t *b)
+{
+    int i;
+
+    for (i = 0; i < b->len; i++)
+        if (b->ops[i].instruction != mem_read_32(ctx, b->start + 4 * i))
+            return 0;
+    return 1;
+}
+
+// Los dos bloques salen de las mismas palabras
+static int same_block(const shared_block_t *a, const shared_block_t *b)
+{
+    int i;
+
+    if (a->len != b->len)
+        return 0;
+    for (i = 0; i < a->len; i++)
+        if (a->ops[i].instruction != b->ops[i].instruction)
+            return 0;
+    return 1;
+}
+
+const shared_block_t *code_cache_lookup(sim_context_t *ctx, uint64_t text_hash, uint64_t start)
+{
+    shared_block_t *b = atomic_load_explicit(&buckets[bucket_of(text_hash, start)],
+                                             memory_order_acquire);
+
+    for (; b != NULL; b = b->next)
+        if (b->text_hash == text_hash && b->start == start && same_text(ctx, b))
+            return b;
+    return NULL;
+}
+
+// Desengancha todos los bloques y los retira en la epoca actual
+static void evict_all(void)
+{
+    shared_block_t *b, *last;
+    uint_fast64_t e;
+    int i;
+
+    pthread_mutex_lock(&retire_lock);
+    if (atomic_load(&block_count) < CODE_CACHE_MAX_BLOCKS) {
+        pthread_mutex_unlock(&retire_lock);     // otro hilo ya la vacio
+        return;
+    }
+    e = atomic_load(&global_epoch);
+    if (retired[e % 3] == NULL)
+        atomic_fetch_add(&retired_pending, 1);
+    for (i = 0; i < CODE_CACHE_BUCKETS; i++) {
+        b = atomic_exchange(&buckets[i], NULL);
+        if (b == NULL)
+            continue;
+        for (last = b; last->next != NULL; last = last->next)
+            ;
+        last->next = retired[e % 3];
+        retired[e % 3] = b;
+    }
+    atomic_store(&block_count, 0);
+    // Despues de desenganchar: quien ve la generacion nueva ya no los encuentra
+    atomic_fetch_add(&generation, 1);
+    try_advance();
+    pthread_mutex_unlock(&retire_lock);
+}
+
+const shared_block_t *code_cache_insert(shared_block_t *b)
+{
+    _Atomic(shared_block_t *) *head = &buckets[bucket_of(b->text_hash, b->start)];
+    shared_block_t *first = atomic_load_explicit(head, memory_order_acquire);
+    const shared_block_t *other;
+
+    do {
+        // Otro hilo pudo publicar el mismo bloque mientras se traducia
+        for (other = first; other != NULL; other = other->next)
+            if (other->text_hash == b->text_hash && other->start == b->start &&
+                same_block(other, b)) {
+                free(b);
+                return other;
+            }
+        b->next = first;
+    } while (!atomic_compare_exchange_weak_explicit(head, &first, b,
+                                                    memory_order_release,
+                                                    memory_order_acquire));
+
+    if (atomic_fetch_add(&block_count, 1) + 1 >= CODE_CACHE_MAX_BLOCKS)
+        evict_all();
+    return b;
+}
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "shell.h"
+#include "sim.h"
+
+/*
+ * JIT x86-64
+ *
+ * Traduce un bloque basico ya decodificado a una funcion nativa
+ * int f(CPU_State *s). El puntero al estado queda fijo en rbx durante todo
+ * el bloque y cada registro del guest se direcciona como [rbx + disp32],
+ * asi que las operaciones de la ALU usan el registro del guest directamente
+ * como operando en memoria.
+ *
+ * Se traducen en linea ADDS/SUBS (registro e inmediato), ANDS, EOR, ORR,
+ * MOVZ, LSL/LSR, B, BR, B.cond y HLT. El resto (LDUR*, STUR* e
+ * instrucciones desconocidas) se compila como una llamada directa a su
+ * handler con los operandos ya ligados. Despues de cada store se revisa
+ * block_flush_pending y, si el store piso el texto, se sale del bloque.
+ *
+ * Cada sim_context tiene su propia arena mmap'eada RWX, que se descarta
+ * entera en jit_flush() junto con los bloques. Como el codigo es de un solo
+ * contexto, las direcciones de ctx, RUN_BIT y block_flush_pending quedan
+ * como constantes en el codigo generado.
+ */
+
+#if defined(__x86_64__)
+
+#define JIT_ARENA_SIZE  (16 << 20)
+#define JIT_MAX_OP_SIZE 96      // cota de bytes generados por instruccion
+
+#define REG_DISP(r)   (offsetof(CPU_State, REGS) + 8 * (r))
+#define PC_DISP       offsetof(CPU_State, PC)
+#define FLAG_N_DISP   offsetof(CPU_State, FLAG_N)
+#define FLAG_Z_DISP   offsetof(CPU_State, FLAG_Z)
+
+// Registros del host (campo reg de ModRM / opcode + reg)
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+
+// Proximo byte a emitir; por thread, porque cada contexto compila en el suyo
+static __thread uint8_t *out;
+
+static void emit8(uint8_t v)
+{
+    *out++ = v;
+}
+
+static void emit32(uint32_t v)
+{
+    memcpy(out, &v, 4);
+    out += 4;
+}
+
+static void emit64(uint64_t v)
+{
+    memcpy(out, &v, 8);
+    out += 8;
+}
+
+// <REX.W> opcode reg, [rbx + disp32]
+static void emit_rbx_mem(int rex_w, uint8_t opcode, int reg, uint32_t disp)
+{
+    if (rex_w)
+        emit8(0x48);
+    emit8(opcode);
+    emit8(0x80 | (reg << 3) | 3);   // mod = 10 (disp32), rm = rbx
+    emit32(disp);
+}
+
+// mov reg, imm64
+static void emit_mov_imm64(int reg, uint64_t imm)
+{
+    emit8(0x48);
+    emit8(0xB8 + reg);
+    emit64(imm);
+}
+
+static void emit_xor_eax_eax(void)
+{
+    emit8(0x31);
+    emit8(0xC0);
+}
+
+// rax = Xn, con XZR leyendo 0 (como read_reg)
+static void emit_read_reg(int r)
+{
+    if (r == 31)
+        emit_xor_eax_eax();
+    else
+        emit_rbx_mem(1, 0x8B, RAX, REG_DISP(r));
+}
+
+// Xd = rax; las escrituras a XZR dejan 0 (como write_reg)
+static void emit_write_reg(int r)
+{
+    if (r == 31) {
+        emit_rbx_mem(1, 0xC7, 0, REG_DISP(r));  // mov qword [rbx + d], 0
+        emit32(0);
+    } else {
+        emit_rbx_mem(1, 0x89, RAX, REG_DISP(r));
+    }
+}
+
+// FLAG_Z = (rax == 0), FLAG_N = (rax < 0)
+static void emit_set_flags(void)
+{
+    emit8(0x48); emit8(0x85); emit8(0xC0);              // test rax, rax
+    emit8(0x0F); emit8(0x94); emit8(0xC1);              // sete cl
+    emit8(0x0F); emit8(0xB6); emit8(0xC9);              // movzx ecx, cl
+    emit_rbx_mem(0, 0x89, RCX, FLAG_Z_DISP);
+    emit8(0x0F); emit8(0x98); emit8(0xC1);              // sets cl
+    emit8(0x0F); emit8(0xB6); emit8(0xC9);              // movzx ecx, cl
+    emit_rbx_mem(0, 0x89, RCX, FLAG_N_DISP);
+}
+
+static void emit_set_pc(uint64_t pc)
+{
+    emit_mov_imm64(RAX, pc);
+    emit_rbx_mem(1, 0x89, RAX, PC_DISP);
+}
+
+// return executed
+static void emit_return(int executed)
+{
+    emit8(0xB8);            // mov eax, imm32
+    emit32(executed);
+    emit8(0x5B);            // pop rbx
+    emit8(0xC3);            // ret
+}
+
+// rax op= Xm (op: 0x03 add, 0x2B sub, 0x23 and, 0x33 xor, 0x0B or)
+static void emit_alu_reg(uint8_t opcode, int rm)
+{
+    if (rm == 31) {
+        if (opcode == 0x23)         // and con XZR
+            emit_xor_eax_eax();
+        return;                     // add/sub/xor/or con 0 no cambian rax
+    }
+    emit_rbx_mem(1, opcode, RAX, REG_DISP(rm));
+}
+
+// dl = condicion de B.cond; devuelve FALSE si la condicion no esta soportada
+static int emit_cond(int cond)
+{
+    switch (cond) {
+        case 0x0:   // BEQ: Z == 1
+            emit_rbx_mem(0, 0x83, 7, FLAG_Z_DISP); emit8(1);
+            break;
+        case 0x1:   // BNE: Z == 0
+            emit_rbx_mem(0, 0x83, 7, FLAG_Z_DISP); emit8(0);
+            break;
+        case 0xC:   // BGT: (Z | N) == 0
+            emit_rbx_mem(0, 0x8B, RAX, FLAG_Z_DISP);
+            emit_rbx_mem(0, 0x0B, RAX, FLAG_N_DISP);
+            break;
+        case 0xB:   // BLT: N == 1
+            emit_rbx_mem(0, 0x83, 7, FLAG_N_DISP); emit8(1);
+            break;
+        case 0xA:   // BGE: N == 0
+            emit_rbx_mem(0, 0x83, 7, FLAG_N_DISP); emit8(0);
+            break;
+        case 0xD:   // BLE: Z == 1 || N == 1
+            emit_rbx_mem(0, 0x83, 7, FLAG_Z_DISP); emit8(1);
+            emit8(0x0F); emit8(0x94); emit8(0xC0);      // sete al
+            emit_rbx_mem(0, 0x83, 7, FLAG_N_DISP); emit8(1);
+            emit8(0x0F); emit8(0x94); emit8(0xC2);      // sete dl
+            emit8(0x08); emit8(0xC2);                   // or dl, al
+            return TRUE;
+        default:
+            return FALSE;
+    }
+    emit8(0x0F); emit8(0x94); emit8(0xC2);              // sete dl
+    return TRUE;
+}
+
+// Llamada a d->handler(ctx, s, d) para lo que no se traduce en linea
+static void emit_call_handler(sim_context_t *ctx, const decoded_inst_t *d)
+{
+    emit_mov_imm64(RDI, (uint64_t) ctx);
+    emit8(0x48); emit8(0x89); emit8(0xDE);              // mov rsi, rbx
+    emit_mov_imm64(RDX, (uint64_t) d);
+    emit_mov_imm64(RAX, (uint64_t) d->handler);
+    emit8(0xFF); emit8(0xD0);                           // call rax
+}
+
+// Tras un store: si piso el texto, salir del bloque con pc = next_pc
+static void emit_flush_check(sim_context_t *ctx, uint64_t next_pc, int executed)
+{
+    uint8_t *jump;
+
+    emit_mov_imm64(RAX, (uint64_t) &ctx->engines->block_flush_pending);
+    emit8(0x83); emit8(0x38); emit8(0x00);              // cmp dword [rax], 0
+    emit8(0x74);                                        // je rel8
+    jump = out++;
+    emit_set_pc(next_pc);
+    emit_return(executed);
+    *jump = out - (jump + 1);
+}
+
+static void emit_op(sim_context_t *ctx, const decoded_inst_t *d, uint64_t pc)
+{
+    switch (d->op) {
+        case OP_ADDS:
+        case OP_SUBS:
+        case OP_ANDS:
+            emit_read_reg(d->rn);
+            emit_alu_reg(d->op == OP_ADDS ? 0x03 : d->op == OP_SUBS ? 0x2B : 0x23, d->rm);
+            emit_write_reg(d->rd);
+            emit_set_flags();
+            break;
+        case OP_EOR:
+        case OP_ORR:
+            emit_read_reg(d->rn);
+            emit_alu_reg(d->op == OP_EOR ? 0x33 : 0x0B, d->rm);
+            emit_write_reg(d->rd);
+            break;
+        case OP_ADDS_IMM:
+        case OP_SUBS_IMM:
+            emit_read_reg(d->rn);
+            emit8(0x48);
+            emit8(d->op == OP_ADDS_IMM ? 0x05 : 0x2D);  // add/sub rax, imm32
+            emit32((uint32_t) d->imm);
+            emit_write_reg(d->rd);
+            emit_set_flags();
+            break;
+        case OP_MOVZ:
+            emit_mov_imm64(RAX, d->imm);
+            emit_write_reg(d->rd);
+            break;
+        case OP_LSL:
+        case OP_LSR:
+            emit_rbx_mem(1, 0x8B, RAX, REG_DISP(d->rn));
+            emit8(0x48); emit8(0xC1);
+            emit8(d->op == OP_LSL ? 0xE0 : 0xE8);       // shl/shr rax, imm8
+            emit8((uint8_t) d->imm);
+            emit_write_reg(d->rd);
+            if (d->rd == 31)
+                emit_xor_eax_eax();
+            emit_set_flags();
+            break;
+        case OP_B:
+            emit_set_pc(d->target);
+            break;
+        case OP_BR:
+            emit_rbx_mem(1, 0x8B, RAX, REG_DISP(d->rn));
+            emit_rbx_mem(1, 0x89, RAX, PC_DISP);
+            break;
+        case OP_BCOND:
+            if (!emit_cond(d->cond)) {
+                emit_set_pc(pc + 4);
+                break;
+            }
+            emit_mov_imm64(RAX, pc + 4);
+            emit_mov_imm64(RCX, d->target);
+            emit8(0x84); emit8(0xD2);                   // test dl, dl
+            emit8(0x48); emit8(0x0F); emit8(0x45); emit8(0xC1);  // cmovnz rax, rcx
+            emit_rbx_mem(1, 0x89, RAX, PC_DISP);
+            break;
+        case OP_HLT:
+            emit_mov_imm64(RAX, (uint64_t) &ctx->RUN_BIT);
+            emit8(0xC7); emit8(0x00); emit32(FALSE);    // mov dword [rax], 0
+            emit_set_pc(pc + 4);
+            break;
+        default:
+            emit_call_handler(ctx, d);
+            break;
+    }
+}
+
+native_block_t jit_compile(sim_context_t *ctx, const block_t *b)
+{
+    jit_arena_t *arena = &ctx->engines->jit;
+    uint8_t *entry;
+    int i;
+
+    if (arena->base == NULL && !arena->failed) {
+        arena->base = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena->base == MAP_FAILED) {
+            fprintf(ctx->out, "JIT: can't map code buffer, using the interpreter\n");
+            arena->base = NULL;
+            arena->failed = TRUE;
+        }
+    }
+    if (arena->base == NULL)
+        return NULL;
+    // Arena llena: el bloque sigue interpretado hasta el proximo flush
+    if (arena->used + (b->len + 1) * JIT_MAX_OP_SIZE > JIT_ARENA_SIZE)
+        return NULL;
+
+    entry = out = arena->base + arena->used;
+    emit8(0x53);                                        // push rbx
+    emit8(0x48); emit8(0x89); emit8(0xFB);              // mov rbx, rdi
+
+    for (i = 0; i < b->len; i++) {
+        const decoded_inst_t *d = &b->ops[i];
+        uint64_t pc = b->start + 4 * i;
+
+        emit_op(ctx, d, pc);
+        if (d->flags & INST_STORE)
+            emit_flush_check(ctx, pc + 4, i + 1);
+    }
+
+    // Bloque cortado por longitud: sigue en la instruccion siguiente
+    if (!(b->ops[b->len - 1].flags & INST_ENDS_BLOCK))
+        emit_set_pc(b->start + 4 * b->len);
+    emit_return(b->len);
+
+    arena->used = out - arena->base;
+    return (native_block_t) entry;
+}
+
+void jit_flush(jit_arena_t *jit)
+{
+    jit->used = 0;
+}
+
+void jit_release(jit_arena_t *jit)
+{
+    if (jit->base != NULL)
+        munmap(jit->base, JIT_ARENA_SIZE);
+    jit->base = NULL;
+    jit->used = 0;
+}
+
+#else
+
+native_block_t jit_compile(sim_context_t *ctx, const block_t *b)
+{
+    return NULL;
+}
+
+void jit_flush(jit_arena_t *jit)
+{
+}
+
+void jit_release(jit_arena_t *jit)
+{
+}
+
+#endif
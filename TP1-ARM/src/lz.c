@@ -0,0 +1,127 @@
+#include <string.h>
+#include "lz.h"
+
+#define LZ_HASH_BITS   12
+#define LZ_MIN_MATCH   4
+#define LZ_MAX_OFFSET  65535
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint8_t *put_len(uint8_t *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static uint8_t *put_literals(uint8_t *op, const uint8_t *lit, size_t len, int match_nibble)
+{
+    *op++ = ((len < 15 ? len : 15) << 4) | match_nibble;
+    if (len >= 15)
+        op = put_len(op, len - 15);
+    memcpy(op, lit, len);
+    return op + len;
+}
+
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst)
+{
+    uint32_t table[1 << LZ_HASH_BITS];     // posicion + 1 de cada hash; 0 = vacio
+    uint8_t *op = dst;
+    size_t ip = 0, anchor = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        size_t len, ml;
+
+        table[h] = ip + 1;
+        if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || read32(src + ref - 1) != seq) {
+            ip++;
+            continue;
+        }
+        ref--;
+
+        len = LZ_MIN_MATCH;
+        while (ip + len < n && src[ref + len] == src[ip + len])
+            len++;
+
+        ml = len - LZ_MIN_MATCH;
+        op = put_literals(op, src + anchor, ip - anchor, ml < 15 ? ml : 15);
+        *op++ = (ip - ref) & 0xFF;
+        *op++ = (ip - ref) >> 8;
+        if (ml >= 15)
+            op = put_len(op, ml - 15);
+
+        ip += len;
+        anchor = ip;
+    }
+
+    op = put_literals(op, src + anchor, n - anchor, 0);
+    return op - dst;
+}
+
+// Lee un largo extendido; devuelve FALSE si se acaba la entrada
+static int get_len(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= end)
+            return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+size_t lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    const uint8_t *ip = src, *end = src + n;
+    uint8_t *op = dst, *op_end = dst + cap;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4, ml = token & 0xF, offset;
+
+        if (lit == 15 && !get_len(&ip, end, &lit))
+            return (size_t) -1;
+        if (lit > (size_t) (end - ip) || lit > (size_t) (op_end - op))
+            return (size_t) -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+
+        if (ip == end)
+            break;      // ultima secuencia: solo literales
+
+        if (end - ip < 2)
+            return (size_t) -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (ml == 15 && !get_len(&ip, end, &ml))
+            return (size_t) -1;
+        ml += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t) (op - dst) || ml > (size_t) (op_end - op))
+            return (size_t) -1;
+
+        // Byte a byte: el match puede solaparse con lo que se esta copiando
+        while (ml--) {
+            *op = *(op - offset);
+            op++;
+        }
+    }
+
+    return op - dst;
+}
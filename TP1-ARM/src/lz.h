@@ -0,0 +1,24 @@
+/*
+ * Compresion LZ77 de bloques, con el mismo formato de secuencias que LZ4:
+ * token (largo de literales | largo de match - 4), literales, offset de
+ * 16 bits little-endian. Los largos >= 15 siguen en bytes de 255. La
+ * ultima secuencia lleva solo literales.
+ */
+
+#ifndef _SIM_LZ_H_
+#define _SIM_LZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Tamano maximo de la salida de lz_compress para n bytes de entrada */
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+/* Devuelve los bytes escritos en dst (dst tiene LZ_BOUND(n) bytes) */
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst);
+
+/* Devuelve los bytes escritos en dst, o (size_t) -1 si src esta corrupto
+   o no entra en cap bytes */
+size_t lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+#endif
@@ -17,405 +17,2628 @@
 /***************************************************************/
 
 
-/* !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!! */
-/*          DO NOT MODIFY THIS FILE!                            */
-/*          You should only change sim.c!                       */
-/* !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!! */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "shell.h"
+#include "trace.h"
+
+/***************************************************************/
+/* Main memory.                                                */
+/*                                                             */
+/* The guest sees a sparse 48-bit address space. A two-level   */
+/* page table (2^18 entries per level) maps each 4 KiB guest   */
+/* page to a host page; pages are materialised on the first    */
+/* write, carved out of MAP_NORESERVE anonymous mappings so    */
+/* the kernel supplies them zeroed and only when touched.      */
+/* Reads of pages never written return 0 without allocating.   */
+/* TLB remembers the last page that was translated.            */
+/* mem_reset() unmaps everything for the next program and      */
+/* keeps the zeroed host pages for reuse.                      */
+/* Each sim_context owns one struct sim_memory.                */
+/*                                                             */
+/* Page table entries carry three tag bits. PTE_SHARED pages   */
+/* belong to the snapshot the context was forked from (BASE)   */
+/* and are copied on the first write; PTE_CLEAN pages are the  */
+/* context's own but unchanged since the last snapshot, so the */
+/* next snapshot can reuse BASE's copy. PTE_DUMPED pages hold  */
+/* what the last mdump --changed showed. The TLB only lets     */
+/* writes through to untagged pages, so the first write to a   */
+/* tagged one takes the slow path and clears its tags.         */
+/***************************************************************/
+
+#define PAGE_SHIFT  12
+#define PAGE_SIZE   (1 << PAGE_SHIFT)
+#define PAGE_MASK   (PAGE_SIZE - 1)
+#define PT_BITS     18
+#define PT_ENTRIES  (1 << PT_BITS)
+#define PT_PAGES    (1ULL << (2 * PT_BITS))	/* pages in 48 bits */
+
+#define MEM_CHUNK_SIZE (64 << 20)	/* host address space per mmap */
+
+#define PTE_SHARED 0x1
+#define PTE_CLEAN  0x2
+#define PTE_DUMPED 0x4
+#define PTE_FLAGS  (PTE_SHARED | PTE_CLEAN | PTE_DUMPED)
+#define PTE_HOST(e) ((uint8_t *) ((uintptr_t) (e) & ~(uintptr_t) PTE_FLAGS))
+#define PTE_TAGS(e) ((uintptr_t) (e) & PTE_FLAGS)
+#define PTE_SNAPSHOT_TAGS(e) ((uintptr_t) (e) & (PTE_SHARED | PTE_CLEAN))
+
+/* save / restore file: this header, the page numbers, then the pages
+   themselves from the next PAGE_SIZE boundary so they can be mapped */
+#define STATE_MAGIC   "ARMSTATE"
+#define STATE_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  uint64_t pc;
+  int64_t regs[ARM_REGS];
+  int32_t flag_n, flag_z;
+  int32_t run_bit;
+  uint32_t instruction_count;
+  uint64_t page_count;
+} state_file_header_t;
+
+#define STATE_DATA_OFFSET(count) \
+  ((sizeof(state_file_header_t) + (count) * sizeof(uint64_t) + PAGE_MASK) & ~(uint64_t) PAGE_MASK)
+
+/* rdump/mdump --format=: text as always, one JSON line, or a binary
+   record in the dumpsim file (little-endian, back to back) */
+#define DUMP_TEXT 0
+#define DUMP_JSON 1
+#define DUMP_BIN  2
+
+#define DUMP_VERSION 1
+
+typedef struct {
+  char magic[8];		/* "ARMRDUMP" */
+  uint32_t version;
+  uint32_t instruction_count;
+  uint64_t pc;
+  int64_t regs[ARM_REGS];
+  int32_t flag_n, flag_z;
+} rdump_record_t;
+
+typedef struct {
+  char magic[8];		/* "ARMMDUMP" */
+  uint32_t version;
+  uint32_t count;		/* words that follow, from start up */
+  uint64_t start;
+} mdump_header_t;
+
+struct sim_memory {
+  uint8_t **PAGE_TABLE[PT_ENTRIES];
+
+  struct {
+    uint64_t page;
+    uint8_t *host;
+    int writable;	/* page is own and dirty */
+  } TLB;
+
+  struct {
+    uint8_t *next, *end;	/* unused part of the current chunk */
+    uint8_t **chunks;		/* every chunk, to unmap them */
+    size_t count;
+  } POOL;
+
+  struct {
+    struct mem_page {
+      uint64_t page;		/* guest page number */
+      uint8_t *host;
+    } *list;			/* every materialised page, for mem_reset */
+    size_t count, size;
+    uint8_t **free;		/* zeroed pages released by mem_reset */
+    size_t free_count;
+  } PAGES;
+
+  struct {
+    struct mem_page *list;	/* by page: contents last shown by */
+    size_t count, size;		/* mdump --changed (host is malloc'ed) */
+  } DUMPED;
+
+  struct sim_snapshot *BASE;	/* forked from or last taken, or NULL */
+};
+
+/* Copy-on-write checkpoint: CPU state plus an image of every page */
+struct sim_snapshot {
+  CPU_State state;
+  int RUN_BIT;
+  int INSTRUCTION_COUNT;
+  struct snapshot_page {
+    uint64_t page;
+    const uint8_t *data;	/* in this snapshot's images or a parent's */
+  } *pages;
+  size_t count;
+  uint8_t *images;		/* pages dirtied since the parent */
+  void *mapping;		/* or the file mmap'ed by sim_snapshot_load */
+  size_t mapping_size;
+  struct sim_snapshot *parent;	/* owner of the other pages */
+  atomic_int refs;		/* forked contexts, children, the taker */
+};
+
+/* Record mode: a checkpoint every INTERVAL instructions, so rstep and
+   rgo go back by forking the nearest one and replaying forward */
+struct sim_recording {
+  int INTERVAL;
+  sim_snapshot_t **CHECKPOINTS;	/* by instruction count, oldest first */
+  int count, size;
+};
+
+/***************************************************************/
+/* Simulator settings shared by every context.                 */
+/***************************************************************/
+
+int HEADLESS;	/* driven by command-line flags: no prompt or banners */
+
+const char *ENGINE_NAMES[] = { "interp", "block", "jit", "threaded" };
+
+#define N_ENGINES (sizeof(ENGINE_NAMES)/sizeof(ENGINE_NAMES[0]))
+
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_translate                                    */
+/*                                                             */
+/* Purpose: Return the host address backing a guest address,  */
+/*          or NULL if its page has not been materialised      */
+/*                                                             */
+/***************************************************************/
+static inline uint8_t *mem_translate(struct sim_memory *m, uint64_t address)
+{
+    uint64_t page = address >> PAGE_SHIFT;
+    uint8_t **level2;
+    uint8_t *host;
+
+    if (page == m->TLB.page)
+        return m->TLB.host + (address & PAGE_MASK);
+
+    if (page >= PT_PAGES)
+        return NULL;
+    level2 = m->PAGE_TABLE[page >> PT_BITS];
+    if (level2 == NULL)
+        return NULL;
+    host = level2[page & (PT_ENTRIES - 1)];
+    if (host == NULL)
+        return NULL;
+
+    m->TLB.page = page;
+    m->TLB.host = PTE_HOST(host);
+    m->TLB.writable = PTE_TAGS(host) == 0;
+    return m->TLB.host + (address & PAGE_MASK);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_new_page                                     */
+/*                                                             */
+/* Purpose: A zeroed host page for the context, from the free  */
+/*          list or the pool, recorded in PAGES.list           */
+/*                                                             */
+/***************************************************************/
+static uint8_t *mem_new_page(struct sim_memory *m, uint64_t page)
+{
+    uint8_t *host;
+
+    if (m->PAGES.free_count > 0) {
+        host = m->PAGES.free[--m->PAGES.free_count];
+    } else {
+        if (m->POOL.next == m->POOL.end) {
+            m->POOL.next = mmap(NULL, MEM_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (m->POOL.next == MAP_FAILED) {
+                printf("Error: Can't allocate guest memory\n");
+                exit(-1);
+            }
+            m->POOL.end = m->POOL.next + MEM_CHUNK_SIZE;
+            m->POOL.chunks = realloc(m->POOL.chunks, (m->POOL.count + 1) * sizeof(uint8_t *));
+            assert(m->POOL.chunks != NULL);
+            m->POOL.chunks[m->POOL.count++] = m->POOL.next;
+        }
+        host = m->POOL.next;
+        m->POOL.next += PAGE_SIZE;
+    }
+
+    if (m->PAGES.count == m->PAGES.size) {
+        m->PAGES.size = m->PAGES.size ? 2 * m->PAGES.size : 64;
+        m->PAGES.list = realloc(m->PAGES.list, m->PAGES.size * sizeof(*m->PAGES.list));
+        assert(m->PAGES.list != NULL);
+    }
+    m->PAGES.list[m->PAGES.count].page = page;
+    m->PAGES.list[m->PAGES.count].host = host;
+    m->PAGES.count++;
+    return host;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_materialise                                  */
+/*                                                             */
+/* Purpose: Like mem_translate, but for writing: back the page */
+/*          with a fresh zeroed host page if needed, copy a    */
+/*          snapshot's page and mark the page dirty. NULL      */
+/*          above 48 bits.                                     */
+/*                                                             */
+/***************************************************************/
+static uint8_t *mem_materialise(struct sim_memory *m, uint64_t address)
+{
+    uint64_t page = address >> PAGE_SHIFT;
+    uint8_t ***level2;
+    uint8_t **entry;
+
+    if (page == m->TLB.page && m->TLB.writable)
+        return m->TLB.host + (address & PAGE_MASK);
+    if (page >= PT_PAGES)
+        return NULL;
+
+    level2 = &m->PAGE_TABLE[page >> PT_BITS];
+    if (*level2 == NULL) {
+        *level2 = calloc(PT_ENTRIES, sizeof(uint8_t *));
+        assert(*level2 != NULL);
+    }
+    entry = &(*level2)[page & (PT_ENTRIES - 1)];
+
+    if (*entry == NULL)
+        *entry = mem_new_page(m, page);
+    else if (PTE_TAGS(*entry) & PTE_SHARED)
+        *entry = memcpy(mem_new_page(m, page), PTE_HOST(*entry), PAGE_SIZE);
+    else
+        *entry = PTE_HOST(*entry);
+
+    m->TLB.page = page;
+    m->TLB.host = *entry;
+    m->TLB.writable = TRUE;
+    return *entry + (address & PAGE_MASK);
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the memory fast path assumes a little-endian host"
+#endif
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_written                                      */
+/*                                                             */
+/* Purpose: Invalidate pre-decoded text words under a store    */
+/*                                                             */
+/***************************************************************/
+static inline void mem_written(sim_context_t *ctx, uint64_t address, int size)
+{
+    uint64_t word;
+
+    if (address + size <= MEM_TEXT_START ||
+            address >= MEM_TEXT_START + MEM_TEXT_SIZE)
+        return;
+    for (word = address & ~3ULL; word < address + size; word += 4)
+        decode_cache_invalidate(ctx, word);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_read / mem_write                             */
+/*                                                             */
+/* Purpose: Little-endian access of size bytes. An access that */
+/*          fits in one page is a single host load or store;   */
+/*          one that straddles two pages goes byte by byte     */
+/*                                                             */
+/***************************************************************/
+static inline uint64_t mem_read(sim_context_t *ctx, uint64_t address, int size)
+{
+    uint64_t value = 0;
+    uint8_t *host;
+    int i;
+
+    if ((address & PAGE_MASK) <= PAGE_SIZE - size) {
+        if ((host = mem_translate(ctx->mem, address)) != NULL)
+            memcpy(&value, host, size);
+        return value;
+    }
+
+    for (i = size - 1; i >= 0; i--) {
+        host = mem_translate(ctx->mem, address + i);
+        value = (value << 8) | (host != NULL ? *host : 0);
+    }
+    return value;
+}
+
+static inline void mem_write(sim_context_t *ctx, uint64_t address, uint64_t value, int size)
+{
+    uint8_t *host;
+    int i;
+
+    if ((address & PAGE_MASK) <= PAGE_SIZE - size) {
+        if ((host = mem_materialise(ctx->mem, address)) != NULL)
+            memcpy(host, &value, size);
+    } else {
+        for (i = 0; i < size; i++) {
+            host = mem_materialise(ctx->mem, address + i);
+            if (host != NULL)
+                *host = (value >> (8 * i)) & 0xFF;
+        }
+    }
+    mem_written(ctx, address, size);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_read_8/16/32/64                              */
+/*                                                             */
+/* Purpose: Read a byte, half-word, word or double-word from   */
+/*          memory                                             */
+/*                                                             */
+/***************************************************************/
+uint8_t mem_read_8(sim_context_t *ctx, uint64_t address)
+{
+    return mem_read(ctx, address, 1);
+}
+
+uint16_t mem_read_16(sim_context_t *ctx, uint64_t address)
+{
+    return mem_read(ctx, address, 2);
+}
+
+uint32_t mem_read_32(sim_context_t *ctx, uint64_t address)
+{
+    return mem_read(ctx, address, 4);
+}
+
+uint64_t mem_read_64(sim_context_t *ctx, uint64_t address)
+{
+    return mem_read(ctx, address, 8);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_write_8/16/32/64                             */
+/*                                                             */
+/* Purpose: Write a byte, half-word, word or double-word to    */
+/*          memory                                             */
+/*                                                             */
+/***************************************************************/
+void mem_write_8(sim_context_t *ctx, uint64_t address, uint8_t value)
+{
+    mem_write(ctx, address, value, 1);
+}
+
+void mem_write_16(sim_context_t *ctx, uint64_t address, uint16_t value)
+{
+    mem_write(ctx, address, value, 2);
+}
+
+void mem_write_32(sim_context_t *ctx, uint64_t address, uint32_t value)
+{
+    mem_write(ctx, address, value, 4);
+}
+
+void mem_write_64(sim_context_t *ctx, uint64_t address, uint64_t value)
+{
+    mem_write(ctx, address, value, 8);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_write_block                                  */
+/*                                                             */
+/* Purpose: Copy size bytes from the host into guest memory,   */
+/*          one page-sized memcpy at a time                    */
+/*                                                             */
+/***************************************************************/
+void mem_write_block(sim_context_t *ctx, uint64_t address, const void *src, uint64_t size)
+{
+    const uint8_t *from = src;
+    uint64_t done = 0;
+
+    while (done < size) {
+        uint64_t chunk = PAGE_SIZE - ((address + done) & PAGE_MASK);
+        uint8_t *host;
+
+        if (chunk > size - done)
+            chunk = size - done;
+        if ((host = mem_materialise(ctx->mem, address + done)) != NULL)
+            memcpy(host, from + done, chunk);
+        done += chunk;
+    }
+    mem_written(ctx, address, size);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_hash                                         */
+/*                                                             */
+/* Purpose: Hash the contents of a guest range, so contexts    */
+/*          that loaded the same program can recognise it.     */
+/*          Pages never materialised read as zero and are      */
+/*          skipped.                                           */
+/*                                                             */
+/***************************************************************/
+uint64_t mem_hash(sim_context_t *ctx, uint64_t address, uint64_t size)
+{
+    uint64_t h = 0xCBF29CE484222325ULL, word, end = address + size;
+    uint64_t chunk, i;
+    uint8_t *host;
+
+    while (address < end) {
+        chunk = PAGE_SIZE - (address & PAGE_MASK);
+        if (chunk > end - address)
+            chunk = end - address;
+        if ((host = mem_translate(ctx->mem, address)) != NULL) {
+            h = (h ^ address) * 0x100000001B3ULL;
+            for (i = 0; i < chunk; i += sizeof(word)) {
+                word = 0;
+                memcpy(&word, host + i, chunk - i < sizeof(word) ? chunk - i : sizeof(word));
+                h = (h ^ word) * 0x100000001B3ULL;
+                h ^= h >> 29;
+            }
+        }
+        address += chunk;
+    }
+    return h;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_dumped                                       */
+/*                                                             */
+/* Purpose: The contents of a page as mdump --changed last     */
+/*          showed them, or NULL if it never showed a non-zero */
+/*          word of it. With create, a zeroed copy is added.   */
+/*                                                             */
+/***************************************************************/
+static uint8_t *mem_dumped(struct sim_memory *m, uint64_t page, int create)
+{
+    size_t lo = 0, hi = m->DUMPED.count, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (m->DUMPED.list[mid].page == page)
+            return m->DUMPED.list[mid].host;
+        if (m->DUMPED.list[mid].page < page)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!create)
+        return NULL;
+
+    if (m->DUMPED.count == m->DUMPED.size) {
+        m->DUMPED.size = m->DUMPED.size ? 2 * m->DUMPED.size : 16;
+        m->DUMPED.list = realloc(m->DUMPED.list, m->DUMPED.size * sizeof(*m->DUMPED.list));
+        assert(m->DUMPED.list != NULL);
+    }
+    memmove(&m->DUMPED.list[lo + 1], &m->DUMPED.list[lo],
+            (m->DUMPED.count - lo) * sizeof(*m->DUMPED.list));
+    m->DUMPED.count++;
+    m->DUMPED.list[lo].page = page;
+    m->DUMPED.list[lo].host = calloc(1, PAGE_SIZE);
+    assert(m->DUMPED.list[lo].host != NULL);
+    return m->DUMPED.list[lo].host;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_next_change                                  */
+/*                                                             */
+/* Purpose: Find the first word-aligned word in                */
+/*          [*address, stop] that differs from what mdump      */
+/*          --changed last showed, remember its value and move */
+/*          *address past it. Pages tagged PTE_DUMPED have not */
+/*          been written since and are skipped without reading */
+/*          them. Return FALSE when there are no more changes. */
+/*                                                             */
+/***************************************************************/
+static int mem_next_change(sim_context_t *ctx, uint64_t *address, uint64_t stop,
+                           uint32_t *value)
+{
+    struct sim_memory *m = ctx->mem;
+    uint64_t page, end;
+    uint8_t **entry, *host, *shown;
+    uint32_t now, before;
+
+    while (*address <= stop) {
+        page = *address >> PAGE_SHIFT;
+        entry = NULL;
+        if (page < PT_PAGES && m->PAGE_TABLE[page >> PT_BITS] != NULL)
+            entry = &m->PAGE_TABLE[page >> PT_BITS][page & (PT_ENTRIES - 1)];
+        if (entry != NULL && (PTE_TAGS(*entry) & PTE_DUMPED)) {
+            *address = (page + 1) << PAGE_SHIFT;
+            continue;
+        }
+
+        host = entry != NULL ? PTE_HOST(*entry) : NULL;
+        shown = mem_dumped(m, page, FALSE);
+        if (host == NULL && shown == NULL) {    /* zero, and shown as zero */
+            *address = (page + 1) << PAGE_SHIFT;
+            continue;
+        }
+        end = ((page + 1) << PAGE_SHIFT) - 4;
+        if (end > stop)
+            end = stop;
+        for (; *address <= end; *address += 4) {
+            now = before = 0;
+            if (host != NULL)
+                memcpy(&now, host + (*address & PAGE_MASK), 4);
+            if (shown != NULL)
+                memcpy(&before, shown + (*address & PAGE_MASK), 4);
+            if (now != before) {
+                if (shown == NULL)
+                    shown = mem_dumped(m, page, TRUE);
+                memcpy(shown + (*address & PAGE_MASK), &now, 4);
+                *value = now;
+                *address += 4;
+                return TRUE;
+            }
+        }
+
+        /* nothing left to show until the page is written again */
+        if (host != NULL && shown != NULL && memcmp(host, shown, PAGE_SIZE) == 0) {
+            *entry = (uint8_t *) ((uintptr_t) *entry | PTE_DUMPED);
+            if (m->TLB.page == page)
+                m->TLB.writable = FALSE;
+        }
+    }
+    return FALSE;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_forget_dumps                                 */
+/*                                                             */
+/* Purpose: Forget what the changed dumps showed, for a reset  */
+/*          context that goes on to run something unrelated   */
+/*                                                             */
+/***************************************************************/
+static void mem_forget_dumps(sim_context_t *ctx)
+{
+    struct sim_memory *m = ctx->mem;
+    size_t i;
+
+    for (i = 0; i < m->DUMPED.count; i++)
+        free(m->DUMPED.list[i].host);
+    m->DUMPED.count = 0;
+    memset(&ctx->DUMPED_STATE, 0, sizeof(ctx->DUMPED_STATE));
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_reset                                        */
+/*                                                             */
+/* Purpose: Forget every materialised page. The host pages    */
+/*          are zeroed and kept for reuse, so the next program */
+/*          only touches the pages it writes; pre-decoded text */
+/*          is dropped.                                        */
+/*                                                             */
+/***************************************************************/
+static void mem_reset(sim_context_t *ctx)
+{
+    struct sim_memory *m = ctx->mem;
+    struct snapshot_page *sp;
+    struct mem_page *p;
+    size_t i;
+
+    if (m->BASE != NULL) {
+        for (i = 0; i < m->BASE->count; i++) {
+            sp = &m->BASE->pages[i];
+            m->PAGE_TABLE[sp->page >> PT_BITS][sp->page & (PT_ENTRIES - 1)] = NULL;
+            mem_written(ctx, sp->page << PAGE_SHIFT, PAGE_SIZE);
+        }
+        sim_snapshot_release(m->BASE);
+        m->BASE = NULL;
+        m->TLB.page = ~0ULL;
+    }
+
+    if (m->PAGES.count == 0)
+        return;
+    /* new pages are only carved when the free list is empty, so there
+       are never more pages in total than list entries */
+    m->PAGES.free = realloc(m->PAGES.free, m->PAGES.size * sizeof(uint8_t *));
+    assert(m->PAGES.free != NULL);
+
+    for (i = 0; i < m->PAGES.count; i++) {
+        p = &m->PAGES.list[i];
+        memset(p->host, 0, PAGE_SIZE);
+        m->PAGE_TABLE[p->page >> PT_BITS][p->page & (PT_ENTRIES - 1)] = NULL;
+        m->PAGES.free[m->PAGES.free_count++] = p->host;
+        mem_written(ctx, p->page << PAGE_SHIFT, PAGE_SIZE);
+    }
+    m->PAGES.count = 0;
+    m->TLB.page = ~0ULL;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: sim_context_create / destroy / reset             */
+/*                                                             */
+/* Purpose: Allocate, free or re-initialise everything one     */
+/*          simulation owns                                    */
+/*                                                             */
+/***************************************************************/
+sim_context_t *sim_context_create(void)
+{
+    sim_context_t *ctx = calloc(1, sizeof(sim_context_t));
+
+    assert(ctx != NULL);
+    ctx->ENGINE = ENGINE_INTERP;
+    ctx->out = stdout;
+    ctx->mem = calloc(1, sizeof(struct sim_memory));
+    ctx->engines = engines_create();
+    assert(ctx->mem != NULL && ctx->engines != NULL);
+    ctx->mem->TLB.page = ~0ULL;
+    return ctx;
+}
+
+void sim_context_destroy(sim_context_t *ctx)
+{
+    struct sim_memory *m = ctx->mem;
+    size_t i;
+
+    for (i = 0; i < PT_ENTRIES; i++)
+        free(m->PAGE_TABLE[i]);
+    for (i = 0; i < m->POOL.count; i++)
+        munmap(m->POOL.chunks[i], MEM_CHUNK_SIZE);
+    free(m->POOL.chunks);
+    free(m->PAGES.list);
+    free(m->PAGES.free);
+    for (i = 0; i < m->DUMPED.count; i++)
+        free(m->DUMPED.list[i].host);
+    free(m->DUMPED.list);
+    if (m->BASE != NULL)
+        sim_snapshot_release(m->BASE);
+    free(m);
+    if (ctx->record != NULL) {
+        for (i = 0; i < (size_t) ctx->record->count; i++)
+            sim_snapshot_release(ctx->record->CHECKPOINTS[i]);
+        free(ctx->record->CHECKPOINTS);
+        free(ctx->record);
+    }
+    engines_destroy(ctx->engines);
+    free(ctx);
+}
+
+void sim_context_reset(sim_context_t *ctx)
+{
+    mem_reset(ctx);
+    engines_reset(ctx->engines);
+    memset(&ctx->CURRENT_STATE, 0, sizeof(ctx->CURRENT_STATE));
+    ctx->NEXT_STATE = ctx->CURRENT_STATE;
+    ctx->INSTRUCTION_COUNT = 0;
+    ctx->RUN_BIT = FALSE;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: sim_snapshot_take                                */
+/*                                                             */
+/* Purpose: Checkpoint the context. Only the pages written     */
+/*          since its BASE snapshot are copied; the rest are   */
+/*          shared with BASE, which becomes the parent. The    */
+/*          snapshot then becomes the context's BASE.          */
+/*                                                             */
+/***************************************************************/
+sim_snapshot_t *sim_snapshot_take(sim_context_t *ctx)
+{
+    struct sim_memory *m = ctx->mem;
+    sim_snapshot_t *snap = calloc(1, sizeof(sim_snapshot_t));
+    struct snapshot_page *sp;
+    struct mem_page *p;
+    uint8_t **entry;
+    size_t i, dirty = 0, base = m->BASE ? m->BASE->count : 0;
+
+    assert(snap != NULL);
+    snap->state = ctx->CURRENT_STATE;
+    snap->RUN_BIT = ctx->RUN_BIT;
+    snap->INSTRUCTION_COUNT = ctx->INSTRUCTION_COUNT;
+    atomic_init(&snap->refs, 2);	/* caller and ctx->mem->BASE */
+
+    for (i = 0; i < m->PAGES.count; i++) {
+        p = &m->PAGES.list[i];
+        if (PTE_SNAPSHOT_TAGS(m->PAGE_TABLE[p->page >> PT_BITS][p->page & (PT_ENTRIES - 1)]) == 0)
+            dirty++;
+    }
+    snap->pages = malloc((base + dirty) * sizeof(struct snapshot_page));
+    snap->images = malloc(dirty * PAGE_SIZE);
+    assert(snap->pages != NULL && (dirty == 0 || snap->images != NULL));
+
+    /* BASE's pages the context has not written */
+    for (i = 0; i < base; i++) {
+        sp = &m->BASE->pages[i];
+        entry = &m->PAGE_TABLE[sp->page >> PT_BITS][sp->page & (PT_ENTRIES - 1)];
+        if (PTE_SNAPSHOT_TAGS(*entry) != 0)
+            snap->pages[snap->count++] = *sp;
+    }
+    /* and a copy of the ones it has, which become clean */
+    for (i = 0, dirty = 0; i < m->PAGES.count; i++) {
+        p = &m->PAGES.list[i];
+        entry = &m->PAGE_TABLE[p->page >> PT_BITS][p->page & (PT_ENTRIES - 1)];
+        if (PTE_SNAPSHOT_TAGS(*entry) != 0)
+            continue;
+        sp = &snap->pages[snap->count++];
+        sp->page = p->page;
+        sp->data = memcpy(snap->images + dirty++ * PAGE_SIZE, p->host, PAGE_SIZE);
+        *entry = (uint8_t *) ((uintptr_t) *entry | PTE_CLEAN);
+    }
+    m->TLB.writable = FALSE;
+
+    snap->parent = m->BASE;	/* the reference BASE held moves here */
+    m->BASE = snap;
+    return snap;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: sim_snapshot_fork                                */
+/*                                                             */
+/* Purpose: Turn ctx into a copy of the snapshot. Its pages    */
+/*          are mapped read-only and copied on the first       */
+/*          write, so forking costs one page table entry per   */
+/*          page whatever the memory size.                     */
+/*                                                             */
+/***************************************************************/
+void sim_snapshot_fork(sim_snapshot_t *snap, sim_context_t *ctx)
+{
+    struct sim_memory *m = ctx->mem;
+    struct snapshot_page *sp;
+    uint8_t ***level2;
+    size_t i;
+
+    atomic_fetch_add(&snap->refs, 1);	/* before ctx lets go of its BASE */
+    sim_context_reset(ctx);
+    m->BASE = snap;
+    for (i = 0; i < snap->count; i++) {
+        sp = &snap->pages[i];
+        level2 = &m->PAGE_TABLE[sp->page >> PT_BITS];
+        if (*level2 == NULL) {
+            *level2 = calloc(PT_ENTRIES, sizeof(uint8_t *));
+            assert(*level2 != NULL);
+        }
+        (*level2)[sp->page & (PT_ENTRIES - 1)] = (uint8_t *) ((uintptr_t) sp->data | PTE_SHARED);
+        mem_written(ctx, sp->page << PAGE_SHIFT, PAGE_SIZE);
+    }
+
+    ctx->CURRENT_STATE = snap->state;
+    ctx->NEXT_STATE = snap->state;
+    ctx->RUN_BIT = snap->RUN_BIT;
+    ctx->INSTRUCTION_COUNT = snap->INSTRUCTION_COUNT;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: sim_snapshot_release                             */
+/*                                                             */
+/* Purpose: Drop a reference; the snapshot is freed once no    */
+/*          caller, forked context or child snapshot uses it.  */
+/*                                                             */
+/***************************************************************/
+void sim_snapshot_release(sim_snapshot_t *snap)
+{
+    sim_snapshot_t *parent;
+
+    while (snap != NULL && atomic_fetch_sub(&snap->refs, 1) == 1) {
+        parent = snap->parent;
+        free(snap->pages);
+        free(snap->images);
+        if (snap->mapping != NULL)
+            munmap(snap->mapping, snap->mapping_size);
+        free(snap);
+        snap = parent;
+    }
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: sim_context_save                                 */
+/*                                                             */
+/* Purpose: Write the CPU state and every non-zero page to a   */
+/*          file that sim_snapshot_load can map back. Return   */
+/*          FALSE if the file can't be written.                */
+/*                                                             */
+/***************************************************************/
+int sim_context_save(sim_context_t *ctx, const char *filename)
+{
+    static const uint8_t zero[PAGE_SIZE];
+    struct sim_memory *m = ctx->mem;
+    size_t i, count = 0, base = m->BASE ? m->BASE->count : 0;
+    struct snapshot_page *pages, *sp;
+    state_file_header_t h;
+    uint8_t *entry;
+    FILE *f;
+    int ok;
+
+    /* own pages, and BASE's pages not copied yet */
+    pages = malloc((m->PAGES.count + base + 1) * sizeof(struct snapshot_page));
+    assert(pages != NULL);
+    for (i = 0; i < m->PAGES.count; i++) {
+        pages[count].page = m->PAGES.list[i].page;
+        pages[count].data = m->PAGES.list[i].host;
+        count += memcmp(pages[count].data, zero, PAGE_SIZE) != 0;
+    }
+    for (i = 0; i < base; i++) {
+        sp = &m->BASE->pages[i];
+        entry = m->PAGE_TABLE[sp->page >> PT_BITS][sp->page & (PT_ENTRIES - 1)];
+        if ((PTE_TAGS(entry) & PTE_SHARED) && memcmp(sp->data, zero, PAGE_SIZE) != 0)
+            pages[count++] = *sp;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STATE_MAGIC, sizeof(h.magic));
+    h.version = STATE_VERSION;
+    h.page_size = PAGE_SIZE;
+    h.pc = ctx->CURRENT_STATE.PC;
+    memcpy(h.regs, ctx->CURRENT_STATE.REGS, sizeof(h.regs));
+    h.flag_n = ctx->CURRENT_STATE.FLAG_N;
+    h.flag_z = ctx->CURRENT_STATE.FLAG_Z;
+    h.run_bit = ctx->RUN_BIT;
+    h.instruction_count = ctx->INSTRUCTION_COUNT;
+    h.page_count = count;
+
+    if ((f = fopen(filename, "wb")) == NULL) {
+        free(pages);
+        return FALSE;
+    }
+    ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (i = 0; ok && i < count; i++)
+        ok = fwrite(&pages[i].page, sizeof(uint64_t), 1, f) == 1;
+    if (ok)
+        ok = fwrite(zero, 1, STATE_DATA_OFFSET(count) - sizeof(h) - count * sizeof(uint64_t), f) ==
+             STATE_DATA_OFFSET(count) - sizeof(h) - count * sizeof(uint64_t);
+    for (i = 0; ok && i < count; i++)
+        ok = fwrite(pages[i].data, PAGE_SIZE, 1, f) == 1;
+    ok = (fclose(f) == 0) && ok;
+    free(pages);
+    return ok;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: sim_snapshot_load                                */
+/*                                                             */
+/* Purpose: Map a file written by sim_context_save as a        */
+/*          snapshot, without reading the pages: they are      */
+/*          used in place and copied when a fork writes them.  */
+/*          NULL if the file is missing or malformed.          */
+/*                                                             */
+/***************************************************************/
+sim_snapshot_t *sim_snapshot_load(const char *filename)
+{
+    const state_file_header_t *h;
+    const uint64_t *numbers;
+    sim_snapshot_t *snap;
+    struct stat st;
+    void *mapping;
+    uint64_t i, data;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(state_file_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    h = mapping;
+    data = STATE_DATA_OFFSET(h->page_count);
+    if (memcmp(h->magic, STATE_MAGIC, sizeof(h->magic)) != 0 ||
+            h->version != STATE_VERSION || h->page_size != PAGE_SIZE ||
+            h->page_count > (uint64_t) st.st_size / PAGE_SIZE ||
+            data + h->page_count * PAGE_SIZE > (uint64_t) st.st_size) {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+    numbers = (const uint64_t *) (h + 1);
+    for (i = 0; i < h->page_count; i++)
+        if (numbers[i] >= PT_PAGES) {
+            munmap(mapping, st.st_size);
+            return NULL;
+        }
+
+    snap = calloc(1, sizeof(sim_snapshot_t));
+    assert(snap != NULL);
+    snap->pages = malloc(h->page_count * sizeof(struct snapshot_page) + 1);
+    assert(snap->pages != NULL);
+    for (i = 0; i < h->page_count; i++) {
+        snap->pages[i].page = numbers[i];
+        snap->pages[i].data = (const uint8_t *) mapping + data + i * PAGE_SIZE;
+    }
+    snap->count = h->page_count;
+    snap->state.PC = h->pc;
+    memcpy(snap->state.REGS, h->regs, sizeof(h->regs));
+    snap->state.FLAG_N = h->flag_n;
+    snap->state.FLAG_Z = h->flag_z;
+    snap->RUN_BIT = h->run_bit;
+    snap->INSTRUCTION_COUNT = h->instruction_count;
+    snap->mapping = mapping;
+    snap->mapping_size = st.st_size;
+    atomic_init(&snap->refs, 1);
+    return snap;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : help                                            */
+/*                                                             */
+/* Purpose   : Print out a list of commands                    */
+/*                                                             */
+/***************************************************************/
+void help() {                                                    
+  printf("----------------ARM ISIM Help-----------------------\n");
+  printf("go               -  run program to completion         \n");
+  printf("run n            -  execute program for n instructions\n");
+  printf("mdump low high   -  dump memory from low to high      \n");
+  printf("rdump            -  dump the register & bus values    \n");
+  printf("mdump --changed low high, rdump --changed              \n");
+  printf("                 -  only what changed since the last   \n");
+  printf("                    --changed dump                     \n");
+  printf("rdump --format=json|bin, mdump --format=json|bin low high\n");
+  printf("                 -  one JSON line, or a binary record   \n");
+  printf("                    in the dumpsim file only            \n");
+  printf("input reg_no reg_value - set GPR reg_no to reg_value  \n");
+  printf("engine name      -  select engine (interp, block, jit, \n");
+  printf("                    threaded)                          \n");
+  printf("trace n          -  per-instruction trace: 0 off,     \n");
+  printf("                    1 instructions, 2 execution detail\n");
+  printf("tracefile name   -  record a binary trace to name      \n");
+  printf("                    (tracefile - stops recording)      \n");
+  printf("save file        -  write the machine state to file     \n");
+  printf("restore file     -  continue from a state saved to file \n");
+  printf("record n         -  checkpoint every n instructions    \n");
+  printf("                    (record 0 stops recording)         \n");
+  printf("rstep n          -  go back n instructions (recording)  \n");
+  printf("rgo              -  go back to where recording started \n");
+  printf("?                -  display this help menu            \n");
+  printf("quit             -  exit the program                  \n\n");
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : cycle                                           */
+/*                                                             */
+/* Purpose   : Execute a cycle                                 */
+/*                                                             */
+/***************************************************************/
+void cycle(sim_context_t *ctx) {                                                
+
+  process_instruction(ctx);
+  ctx->CURRENT_STATE = ctx->NEXT_STATE;
+  ctx->INSTRUCTION_COUNT++;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : execute                                         */
+/*                                                             */
+/* Purpose   : Execute up to n instructions with the selected  */
+/*             engine, return how many were executed           */
+/*                                                             */
+/***************************************************************/
+int execute(sim_context_t *ctx, int n) {
+  int i;
+
+  /* per-instruction traces are only emitted by process_instruction */
+  if (ctx->ENGINE == ENGINE_INTERP || TRACE_ON(TRACE_INST) || TRACE_RECORD_ON()) {
+    for (i = 0; i < n && ctx->RUN_BIT; i++)
+      cycle(ctx);
+    return i;
+  }
+
+  i = process_instructions(ctx, n);
+  ctx->INSTRUCTION_COUNT += i;
+  return i;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : record_checkpoint                               */
+/*                                                             */
+/* Purpose   : Append a checkpoint of the current state to the */
+/*             recording. Only the pages written since the     */
+/*             previous one are copied.                        */
+/*                                                             */
+/***************************************************************/
+void record_checkpoint(sim_context_t *ctx) {
+  struct sim_recording *r = ctx->record;
+
+  if (r->count == r->size) {
+    r->size = r->size ? 2 * r->size : 64;
+    r->CHECKPOINTS = realloc(r->CHECKPOINTS, r->size * sizeof(sim_snapshot_t *));
+    assert(r->CHECKPOINTS != NULL);
+  }
+  r->CHECKPOINTS[r->count++] = sim_snapshot_take(ctx);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : record_truncate                                 */
+/*                                                             */
+/* Purpose   : Drop every checkpoint after the first keep      */
+/*                                                             */
+/***************************************************************/
+void record_truncate(struct sim_recording *r, int keep) {
+  while (r->count > keep)
+    sim_snapshot_release(r->CHECKPOINTS[--r->count]);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : run_engine                                      */
+/*                                                             */
+/* Purpose   : Execute up to n instructions, stopping at every */
+/*             checkpoint while recording, return how many     */
+/*             were executed                                   */
+/*                                                             */
+/***************************************************************/
+int run_engine(sim_context_t *ctx, int n) {
+  struct sim_recording *r = ctx->record;
+  long long next;
+  int done = 0;
+
+  if (r == NULL)
+    return execute(ctx, n);
+
+  while (done < n && ctx->RUN_BIT) {
+    next = (long long) r->CHECKPOINTS[r->count - 1]->INSTRUCTION_COUNT + r->INTERVAL;
+    if (next - ctx->INSTRUCTION_COUNT < n - done)
+      done += execute(ctx, next - ctx->INSTRUCTION_COUNT);
+    else
+      done += execute(ctx, n - done);
+    if (ctx->INSTRUCTION_COUNT == next)
+      record_checkpoint(ctx);
+  }
+  return done;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : run n                                           */
+/*                                                             */
+/* Purpose   : Simulate ARM for n cycles                       */
+/*                                                             */
+/***************************************************************/
+void run(sim_context_t *ctx, int num_cycles) {                                      
+  if (ctx->RUN_BIT == FALSE) {
+    fprintf(ctx->out, "Can't simulate, Simulator is halted\n\n");
+    return;
+  }
+
+  fprintf(ctx->out, "Simulating for %d cycles...\n\n", num_cycles);
+  if (run_engine(ctx, num_cycles) < num_cycles)
+    fprintf(ctx->out, "Simulator halted\n\n");
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : dump_line                                       */
+/*                                                             */
+/* Purpose   : Format a dump line once and write it to the     */
+/*             output and the dumpsim file                     */
+/*                                                             */
+/***************************************************************/
+void dump_line(sim_context_t *ctx, FILE * dumpsim_file, const char *format, ...) {
+  char line[128];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  fputs(line, ctx->out);
+  fputs(line, dumpsim_file);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : dump_write                                      */
+/*                                                             */
+/* Purpose   : Hand a finished dump to the dumpsim file, and   */
+/*             to the output unless it is binary, in a single  */
+/*             write each                                      */
+/*                                                             */
+/***************************************************************/
+void dump_write(sim_context_t *ctx, FILE * dumpsim_file, char *buf, size_t size, int format) {
+  if (format != DUMP_BIN)
+    fwrite(buf, 1, size, ctx->out);
+  fwrite(buf, 1, size, dumpsim_file);
+  free(buf);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : mdump_format                                    */
+/*                                                             */
+/* Purpose   : mdump as JSON or binary                         */
+/*                                                             */
+/***************************************************************/
+void mdump_format(sim_context_t *ctx, FILE * dumpsim_file, int start, int stop, int format) {
+  mdump_header_t h;
+  char *buf;
+  size_t size;
+  int address;
+  uint32_t value;
+  FILE *f = open_memstream(&buf, &size);
+
+  assert(f != NULL);
+  if (format == DUMP_BIN) {
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "ARMMDUMP", sizeof(h.magic));
+    h.version = DUMP_VERSION;
+    h.count = start <= stop ? ((long long) stop - start) / 4 + 1 : 0;
+    h.start = start;
+    fwrite(&h, sizeof(h), 1, f);
+    for (address = start; address <= stop; address += 4) {
+      value = mem_read_32(ctx, address);
+      fwrite(&value, sizeof(value), 1, f);
+    }
+  } else {
+    fprintf(f, "{\"start\": \"0x%08x\", \"stop\": \"0x%08x\", \"words\": [", start, stop);
+    for (address = start; address <= stop; address += 4)
+      fprintf(f, address == start ? "\"0x%x\"" : ", \"0x%x\"", mem_read_32(ctx, address));
+    fprintf(f, "]}\n");
+  }
+  fclose(f);
+  dump_write(ctx, dumpsim_file, buf, size, format);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : rdump_format                                    */
+/*                                                             */
+/* Purpose   : rdump as JSON or binary                         */
+/*                                                             */
+/***************************************************************/
+void rdump_format(sim_context_t *ctx, FILE * dumpsim_file, int format) {
+  CPU_State *now = &ctx->CURRENT_STATE;
+  rdump_record_t r;
+  char *buf;
+  size_t size;
+  int k;
+  FILE *f = open_memstream(&buf, &size);
+
+  assert(f != NULL);
+  if (format == DUMP_BIN) {
+    memset(&r, 0, sizeof(r));
+    memcpy(r.magic, "ARMRDUMP", sizeof(r.magic));
+    r.version = DUMP_VERSION;
+    r.instruction_count = ctx->INSTRUCTION_COUNT;
+    r.pc = now->PC;
+    memcpy(r.regs, now->REGS, sizeof(r.regs));
+    r.flag_n = now->FLAG_N;
+    r.flag_z = now->FLAG_Z;
+    fwrite(&r, sizeof(r), 1, f);
+  } else {
+    fprintf(f, "{\"instruction_count\": %u, \"pc\": \"0x%" PRIx64 "\", \"regs\": [",
+            ctx->INSTRUCTION_COUNT, now->PC);
+    for (k = 0; k < ARM_REGS; k++)
+      fprintf(f, k == 0 ? "\"0x%" PRIx64 "\"" : ", \"0x%" PRIx64 "\"", now->REGS[k]);
+    fprintf(f, "], \"flag_n\": %d, \"flag_z\": %d}\n", now->FLAG_N, now->FLAG_Z);
+  }
+  fclose(f);
+  dump_write(ctx, dumpsim_file, buf, size, format);
+}
+
+/***************************************************************/ 
+/*                                                             */
+/* Procedure : mdump                                           */
+/*                                                             */
+/* Purpose   : Dump a word-aligned region of memory to the     */
+/*             output file. With changed, only the words that  */
+/*             differ from the last changed dump; format picks */
+/*             a structured output instead.                    */
+/*                                                             */
+/***************************************************************/
+void mdump(sim_context_t *ctx, FILE * dumpsim_file, int start, int stop, int changed, int format) {          
+  int address;
+  uint64_t next;
+  uint32_t value;
+
+  if (format != DUMP_TEXT) {
+    mdump_format(ctx, dumpsim_file, start, stop, format);
+    return;
+  }
+
+  dump_line(ctx, dumpsim_file, "\nMemory content [0x%08x..0x%08x] :\n", start, stop);
+  dump_line(ctx, dumpsim_file, "-------------------------------------\n");
+  if (changed) {
+    next = (int64_t) (start & ~3);	/* sign-extended, as the plain loop reads */
+    while (mem_next_change(ctx, &next, (int64_t) stop, &value)) {
+      address = next - 4;
+      dump_line(ctx, dumpsim_file, "  0x%08x (%d) : 0x%x\n", address, address, value);
+    }
+  } else {
+    for (address = start; address <= stop; address += 4)
+      dump_line(ctx, dumpsim_file, "  0x%08x (%d) : 0x%x\n", address, address, mem_read_32(ctx, address));
+  }
+  dump_line(ctx, dumpsim_file, "\n");
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : rdump                                           */
+/*                                                             */
+/* Purpose   : Dump current register and bus values to the     */   
+/*             output file. With changed, only the ones that   */
+/*             differ from the last changed dump; format picks */
+/*             a structured output instead.                    */
+/*                                                             */
+/***************************************************************/
+void rdump(sim_context_t *ctx, FILE * dumpsim_file, int changed, int format) {                               
+  CPU_State *now = &ctx->CURRENT_STATE, *shown = &ctx->DUMPED_STATE;
+  int k; 
+
+  if (format != DUMP_TEXT) {
+    rdump_format(ctx, dumpsim_file, format);
+    return;
+  }
+
+  dump_line(ctx, dumpsim_file, "\nCurrent register/bus values :\n");
+  dump_line(ctx, dumpsim_file, "-------------------------------------\n");
+  dump_line(ctx, dumpsim_file, "Instruction Count : %u\n", ctx->INSTRUCTION_COUNT);
+  if (!changed || now->PC != shown->PC)
+    dump_line(ctx, dumpsim_file, "PC                : 0x%" PRIx64 "\n", now->PC);
+  dump_line(ctx, dumpsim_file, "Registers:\n");
+  for (k = 0; k < ARM_REGS; k++)
+    if (!changed || now->REGS[k] != shown->REGS[k])
+      dump_line(ctx, dumpsim_file, "X%d: 0x%" PRIx64 "\n", k, now->REGS[k]);
+  if (!changed || now->FLAG_N != shown->FLAG_N)
+    dump_line(ctx, dumpsim_file, "FLAG_N: %d\n", now->FLAG_N);
+  if (!changed || now->FLAG_Z != shown->FLAG_Z)
+    dump_line(ctx, dumpsim_file, "FLAG_Z: %d\n", now->FLAG_Z);
+  dump_line(ctx, dumpsim_file, "\n");
+  if (changed)
+    *shown = *now;
+}
+/***************************************************************/
+/*                                                             */
+/* Procedure : go                                              */
+/*                                                             */
+/* Purpose   : Simulate ARM until HALTed                       */
+/*                                                             */
+/***************************************************************/
+void go(sim_context_t *ctx, FILE * dumpsim_file) {                                                     
+  if (ctx->RUN_BIT == FALSE) {
+    fprintf(ctx->out, "Can't simulate, Simulator is halted\n\n");
+    return;
+  }
+
+  fprintf(ctx->out, "Simulating...\n\n");
+  while (ctx->RUN_BIT)
+    run_engine(ctx, INT_MAX);
+  fprintf(ctx->out, "Simulator halted\n\n");
+}
+
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : record                                          */
+/*                                                             */
+/* Purpose   : Start recording with a checkpoint every n       */
+/*             instructions from here on; 0 stops recording    */
+/*                                                             */
+/***************************************************************/
+void record(sim_context_t *ctx, int n) {
+  if (ctx->record != NULL) {
+    record_truncate(ctx->record, 0);
+    free(ctx->record->CHECKPOINTS);
+    free(ctx->record);
+    ctx->record = NULL;
+  }
+  if (n <= 0)
+    return;
+
+  ctx->record = calloc(1, sizeof(struct sim_recording));
+  assert(ctx->record != NULL);
+  ctx->record->INTERVAL = n;
+  record_checkpoint(ctx);
+  fprintf(ctx->out, "Recording a checkpoint every %d instructions\n", n);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : replay                                          */
+/*                                                             */
+/* Purpose   : Go back to instruction target: fork the latest  */
+/*             checkpoint at or before it and run silently up  */
+/*             to it on the fast engines. Later checkpoints    */
+/*             are dropped; running forward takes them again.  */
+/*                                                             */
+/***************************************************************/
+void replay(sim_context_t *ctx, int target) {
+  struct sim_recording *r = ctx->record;
+  int i, engine = ctx->ENGINE, level = TRACE_LEVEL, recording = TRACE_RECORDING;
+
+  for (i = r->count - 1; i > 0 && r->CHECKPOINTS[i]->INSTRUCTION_COUNT > target; i--)
+    ;
+  if (target < r->CHECKPOINTS[i]->INSTRUCTION_COUNT)
+    target = r->CHECKPOINTS[i]->INSTRUCTION_COUNT;
+  sim_snapshot_fork(r->CHECKPOINTS[i], ctx);
+  record_truncate(r, i + 1);
+
+  /* the engines give the same results, only faster */
+  if (ctx->ENGINE == ENGINE_INTERP)
+    ctx->ENGINE = ENGINE_JIT;
+  TRACE_LEVEL = TRACE_OFF;
+  TRACE_RECORDING = FALSE;
+  run_engine(ctx, target - ctx->INSTRUCTION_COUNT);
+  ctx->ENGINE = engine;
+  TRACE_LEVEL = level;
+  TRACE_RECORDING = recording;
+
+  fprintf(ctx->out, "Back at instruction %d\n\n", ctx->INSTRUCTION_COUNT);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : rstep n                                         */
+/*                                                             */
+/* Purpose   : Undo the last n instructions                    */
+/*                                                             */
+/***************************************************************/
+void rstep(sim_context_t *ctx, int n) {
+  if (ctx->record == NULL) {
+    fprintf(ctx->out, "Can't step back, not recording\n\n");
+    return;
+  }
+  if (n < 0)
+    n = 0;
+  replay(ctx, ctx->INSTRUCTION_COUNT - n);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : rgo                                             */
+/*                                                             */
+/* Purpose   : Go back to where recording started              */
+/*                                                             */
+/***************************************************************/
+void rgo(sim_context_t *ctx) {
+  if (ctx->record == NULL) {
+    fprintf(ctx->out, "Can't step back, not recording\n\n");
+    return;
+  }
+  replay(ctx, 0);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : save                                            */
+/*                                                             */
+/* Purpose   : Write the machine state to a file               */
+/*                                                             */
+/***************************************************************/
+void save(sim_context_t *ctx, char *filename) {
+  if (!sim_context_save(ctx, filename))
+    fprintf(ctx->out, "Error: Can't write state file %s\n", filename);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : restore                                         */
+/*                                                             */
+/* Purpose   : Continue from a state written by save           */
+/*                                                             */
+/***************************************************************/
+void restore(sim_context_t *ctx, char *filename) {
+  sim_snapshot_t *snap = sim_snapshot_load(filename);
+
+  if (snap == NULL) {
+    fprintf(ctx->out, "Error: Can't read state file %s\n", filename);
+    return;
+  }
+  sim_snapshot_fork(snap, ctx);
+  sim_snapshot_release(snap);
+  /* the recorded history led somewhere else */
+  if (ctx->record != NULL)
+    record(ctx, ctx->record->INTERVAL);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : read_option                                     */
+/*                                                             */
+/* Purpose   : Read a --option word if the command line has    */
+/*             one next, without waiting for another line      */
+/*                                                             */
+/***************************************************************/
+int read_option(char *option, int size) {
+  char format[16];
+  int ch;
+
+  while ((ch = getchar()) == ' ' || ch == '\t')
+    ;
+  if (ch != EOF)
+    ungetc(ch, stdin);
+  if (ch != '-')
+    return FALSE;
+  snprintf(format, sizeof(format), "%%%ds", size - 1);
+  return scanf(format, option) == 1;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : dump_format                                     */
+/*                                                             */
+/* Purpose   : DUMP_* for a format name, or -1                 */
+/*                                                             */
+/***************************************************************/
+int dump_format(const char *name) {
+  if (strcmp(name, "text") == 0)
+    return DUMP_TEXT;
+  if (strcmp(name, "json") == 0)
+    return DUMP_JSON;
+  if (strcmp(name, "bin") == 0)
+    return DUMP_BIN;
+  return -1;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : read_dump_options                               */
+/*                                                             */
+/* Purpose   : Read the --changed and --format=name options of */
+/*             a dump command. FALSE after reporting a bad one */
+/*                                                             */
+/***************************************************************/
+int read_dump_options(int *changed, int *format) {
+  char option[20];
+  int ch, ok = TRUE;
+
+  *changed = FALSE;
+  *format = DUMP_TEXT;
+  while (ok && read_option(option, sizeof(option))) {
+    if (strcmp(option, "--changed") == 0)
+      *changed = TRUE;
+    else if (strncmp(option, "--format=", 9) != 0 || (*format = dump_format(option + 9)) < 0) {
+      printf("Invalid option %s\n", option);
+      ok = FALSE;
+    }
+  }
+  if (ok && *changed && *format != DUMP_TEXT) {
+    printf("--changed only applies to text dumps\n");
+    ok = FALSE;
+  }
+  if (!ok)	/* drop the rest of the command */
+    while ((ch = getchar()) != '\n' && ch != EOF)
+      ;
+  return ok;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : get_command                                     */
+/*                                                             */
+/* Purpose   : Read a command from standard input.             */  
+/*                                                             */
+/***************************************************************/
+void get_command(sim_context_t *ctx, FILE * dumpsim_file) {                         
+  char buffer[20], filename[256];
+  int i, start, stop, cycles, changed, format;
+  int register_no;
+  int64_t register_value;
+
+  printf("ARM-SIM> ");
+
+  if (scanf("%s", buffer) == EOF)
+      exit(0);
+
+  printf("\n");
+
+  switch(buffer[0]) {
+  case 'G':
+  case 'g':
+    go(ctx, dumpsim_file);
+    break;
+
+  case 'M':
+  case 'm':
+    if (!read_dump_options(&changed, &format))
+        break;
+    if (scanf("%i %i", &start, &stop) != 2)
+        break;
+
+    mdump(ctx, dumpsim_file, start, stop, changed, format);
+    break;
+
+  case '?':
+    help();
+    break;
+
+  case 'Q':
+  case 'q':
+    printf("Bye.\n");
+    exit(0);
+
+  case 'R':
+  case 'r':
+    if (buffer[1] == 'd' || buffer[1] == 'D') {
+	    if (read_dump_options(&changed, &format))
+	      rdump(ctx, dumpsim_file, changed, format);
+    }
+    else if ((buffer[1] == 'e' || buffer[1] == 'E') && (buffer[2] == 'c' || buffer[2] == 'C')) {
+	    if (scanf("%d", &cycles) != 1) break;
+	    record(ctx, cycles);
+    } else if (buffer[1] == 'e' || buffer[1] == 'E') {
+	    if (scanf("%255s", filename) != 1) break;
+	    restore(ctx, filename);
+    } else if (buffer[1] == 's' || buffer[1] == 'S') {
+	    if (scanf("%d", &cycles) != 1) break;
+	    rstep(ctx, cycles);
+    } else if (buffer[1] == 'g' || buffer[1] == 'G')
+	    rgo(ctx);
+    else {
+	    if (scanf("%d", &cycles) != 1) break;
+	    run(ctx, cycles);
+    }
+    break;
+
+  case 'E':
+  case 'e':
+    if (scanf("%19s", buffer) != 1)
+        break;
+    for (i = 0; i < N_ENGINES; i++)
+      if (strcmp(buffer, ENGINE_NAMES[i]) == 0)
+        break;
+    if (i == N_ENGINES) {
+      printf("Invalid engine %s\n", buffer);
+      break;
+    }
+    ctx->ENGINE = i;
+    printf("Engine: %s\n", ENGINE_NAMES[ctx->ENGINE]);
+    break;
+
+  case 'T':
+  case 't':
+    if (strlen(buffer) > 5 && (buffer[5] == 'f' || buffer[5] == 'F')) {
+      if (scanf("%255s", filename) != 1)
+        break;
+      if (strcmp(filename, "-") == 0) {
+        trace_close();
+        break;
+      }
+      if (!SIM_TRACE)
+        printf("Tracing is not compiled into this build\n");
+      else if (!trace_open(filename, TRUE))
+        printf("Error: Can't open trace file %s\n", filename);
+      break;
+    }
+    if (scanf("%d", &i) != 1)
+        break;
+    if (!SIM_TRACE && i != TRACE_OFF) {
+      printf("Tracing is not compiled into this build\n");
+      break;
+    }
+    TRACE_LEVEL = i;
+    break;
+
+  case 'S':
+  case 's':
+    if (scanf("%255s", filename) != 1)
+        break;
+    save(ctx, filename);
+    break;
+
+  case 'I':
+  case 'i':
+   if (scanf("%i %" PRIx64, &register_no, &register_value) != 2)
+      break;
+   ctx->CURRENT_STATE.REGS[register_no] = register_value;
+   ctx->NEXT_STATE.REGS[register_no] = register_value;
+   /* replay can't redo the edit, so checkpoint right after it */
+   if (ctx->record != NULL)
+     record_checkpoint(ctx);
+   break;
+
+  default:
+    printf("Invalid Command\n");
+    break;
+  }
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : load_binary                                    */
+/*                                                            */
+/* Purpose   : Map a raw little-endian program image and copy */
+/*             it into the text segment. Returns word count.  */
+/*                                                            */
+/**************************************************************/
+int load_binary(sim_context_t *ctx, char *program_filename) {
+  struct stat st;
+  void *image;
+  int fd;
+
+  fd = open(program_filename, O_RDONLY);
+  if (fd < 0) {
+    printf("Error: Can't open program file %s\n", program_filename);
+    exit(-1);
+  }
+  if (fstat(fd, &st) < 0 || st.st_size % 4 != 0) {
+    printf("Error: Malformed program file %s\n", program_filename);
+    exit(-1);
+  }
+
+  if (st.st_size > 0) {
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+      printf("Error: Can't map program file %s\n", program_filename);
+      exit(-1);
+    }
+    mem_write_block(ctx, MEM_TEXT_START, image, st.st_size);
+    munmap(image, st.st_size);
+  }
+  close(fd);
+
+  return st.st_size / 4;
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : load_elf_sections                              */
+/*                                                            */
+/* Purpose   : Load an unlinked object (.o): executable       */
+/*             sections go to the text segment and the other  */
+/*             allocated ones to the data segment, in order.  */
+/*             Relocations are not applied. Returns bytes.    */
+/*                                                            */
+/**************************************************************/
+uint64_t load_elf_sections(sim_context_t *ctx, const uint8_t *image, size_t size) {
+  const Elf64_Ehdr *eh = (const Elf64_Ehdr *) image;
+  const Elf64_Shdr *sh;
+  uint64_t text = MEM_TEXT_START, data = MEM_DATA_START, *dest;
+  int i;
+
+  if (eh->e_shoff == 0 || eh->e_shoff + (uint64_t) eh->e_shnum * sizeof(*sh) > size)
+    return 0;
+  sh = (const Elf64_Shdr *) (image + eh->e_shoff);
+
+  for (i = 0; i < eh->e_shnum; i++) {
+    if (!(sh[i].sh_flags & SHF_ALLOC) || sh[i].sh_type != SHT_PROGBITS)
+      continue;
+    if (sh[i].sh_offset + sh[i].sh_size > size)
+      return 0;
+    dest = (sh[i].sh_flags & SHF_EXECINSTR) ? &text : &data;
+    if (sh[i].sh_addralign > 1)
+      *dest = (*dest + sh[i].sh_addralign - 1) & ~(sh[i].sh_addralign - 1);
+    mem_write_block(ctx, *dest, image + sh[i].sh_offset, sh[i].sh_size);
+    *dest += sh[i].sh_size;
+  }
+  ctx->CURRENT_STATE.PC = MEM_TEXT_START;
+
+  return (text - MEM_TEXT_START) + (data - MEM_DATA_START);
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : load_elf                                       */
+/*                                                            */
+/* Purpose   : Load an ELF64 AArch64 file. Linked executables */
+/*             have their PT_LOAD segments copied to p_vaddr  */
+/*             and start at e_entry; objects without program  */
+/*             headers go through load_elf_sections.          */
+/*             Returns the number of words loaded.            */
+/*                                                            */
+/**************************************************************/
+int load_elf(sim_context_t *ctx, char *program_filename) {
+  const Elf64_Ehdr *eh;
+  const Elf64_Phdr *ph;
+  struct stat st;
+  uint8_t *image;
+  uint64_t loaded = 0;
+  int fd, i;
+
+  fd = open(program_filename, O_RDONLY);
+  if (fd < 0) {
+    printf("Error: Can't open program file %s\n", program_filename);
+    exit(-1);
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(Elf64_Ehdr)) {
+    printf("Error: Malformed program file %s\n", program_filename);
+    exit(-1);
+  }
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (image == MAP_FAILED) {
+    printf("Error: Can't map program file %s\n", program_filename);
+    exit(-1);
+  }
+  close(fd);
+
+  eh = (const Elf64_Ehdr *) image;
+  if (eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+      eh->e_machine != EM_AARCH64) {
+    printf("Error: %s is not a little-endian ELF64 AArch64 file\n", program_filename);
+    exit(-1);
+  }
+
+  if (eh->e_phnum == 0) {
+    loaded = load_elf_sections(ctx, image, st.st_size);
+  } else if (eh->e_phoff + (uint64_t) eh->e_phnum * sizeof(*ph) <= st.st_size) {
+    ph = (const Elf64_Phdr *) (image + eh->e_phoff);
+    for (i = 0; i < eh->e_phnum; i++) {
+      if (ph[i].p_type != PT_LOAD)
+        continue;
+      if (ph[i].p_offset + ph[i].p_filesz > st.st_size) {
+        loaded = 0;
+        break;
+      }
+      /* p_filesz..p_memsz (.bss) already reads as zero */
+      mem_write_block(ctx, ph[i].p_vaddr, image + ph[i].p_offset, ph[i].p_filesz);
+      loaded += ph[i].p_filesz;
+    }
+    ctx->CURRENT_STATE.PC = eh->e_entry;
+  }
+  munmap(image, st.st_size);
+
+  if (loaded == 0) {
+    printf("Error: Malformed program file %s\n", program_filename);
+    exit(-1);
+  }
+
+  return (loaded + 3) / 4;
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : load_hex                                       */
+/*                                                            */
+/* Purpose   : Read a program written as one hex word per     */
+/*             line (asm2hex output). Returns word count.     */
+/*                                                            */
+/**************************************************************/
+int load_hex(sim_context_t *ctx, char *program_filename) {
+  FILE * prog;
+  int ii, word;
+
+  /* Open program file. */
+  prog = fopen(program_filename, "r");
+  if (prog == NULL) {
+    printf("Error: Can't open program file %s\n", program_filename);
+    exit(-1);
+  }
+
+  /* Read in the program. */
+
+  ii = 0;
+  int bytes_read = EOF;
+  while ((bytes_read=fscanf(prog, "%x\n", &word)) > 0) {
+    mem_write_32(ctx, MEM_TEXT_START + ii, word);
+    ii += 4;
+  }
+  if (bytes_read == 0) {
+    printf("Error: Malformed program file %s\n", program_filename);
+    exit(-1);
+  }
+  fclose(prog);
 
-#include <assert.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <inttypes.h>
-#include "shell.h"
+  return ii / 4;
+}
 
-/***************************************************************/
-/* Main memory.                                                */
-/***************************************************************/
+/**************************************************************/
+/*                                                            */
+/* Procedure : is_elf                                         */
+/*                                                            */
+/* Purpose   : Check a program file for the ELF magic.        */
+/*                                                            */
+/**************************************************************/
+int is_elf(char *program_filename) {
+  char magic[SELFMAG];
+  FILE * prog;
+  int found = FALSE;
 
-#define MEM_DATA_START  0x10000000
-#define MEM_DATA_SIZE   0x00100000
-#define MEM_TEXT_START  0x00400000
-#define MEM_TEXT_SIZE   0x00100000
-#define MEM_STACK_START 0xfffffffc
-#define MEM_STACK_SIZE  0x00100000
+  prog = fopen(program_filename, "rb");
+  if (prog != NULL) {
+    found = fread(magic, 1, SELFMAG, prog) == SELFMAG &&
+            memcmp(magic, ELFMAG, SELFMAG) == 0;
+    fclose(prog);
+  }
+  return found;
+}
 
-typedef struct {
-    uint64_t start, size;
-    uint8_t *mem;
-} mem_region_t;
-
-/* memory will be dynamically allocated at initialization */
-mem_region_t MEM_REGIONS[] = {
-    { MEM_TEXT_START, MEM_TEXT_SIZE, NULL },
-    { MEM_DATA_START, MEM_DATA_SIZE, NULL },
-    { MEM_STACK_START, MEM_STACK_SIZE, NULL },
-};
+/**************************************************************/
+/*                                                            */
+/* Procedure : load_program                                   */
+/*                                                            */
+/* Purpose   : Load program and service routines into mem.    */
+/*             ELF files are recognised by their magic, files */
+/*             ending in .bin are raw binary images, anything */
+/*             else is read as hex text.                      */
+/*                                                            */
+/**************************************************************/
+void load_program(sim_context_t *ctx, char *program_filename) {                   
+  size_t len = strlen(program_filename);
+  int words;
 
-#define MEM_NREGIONS (sizeof(MEM_REGIONS)/sizeof(mem_region_t))
+  /* loaders that know the entry point override this */
+  ctx->CURRENT_STATE.PC = MEM_TEXT_START;
 
-/***************************************************************/
-/* CPU State info.                                             */
-/***************************************************************/
+  if (is_elf(program_filename))
+    words = load_elf(ctx, program_filename);
+  else if (len > 4 && strcmp(program_filename + len - 4, ".bin") == 0)
+    words = load_binary(ctx, program_filename);
+  else
+    words = load_hex(ctx, program_filename);
 
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_BIT;	/* run bit */
-int INSTRUCTION_COUNT;
+  if (!HEADLESS)
+    printf("Read %d words from program into memory.\n\n", words);
+}
+
+/************************************************************/
+/*                                                          */
+/* Procedure : initialize                                   */
+/*                                                          */
+/* Purpose   : Load machine language program                */ 
+/*             and set up initial state of the machine.     */
+/*                                                          */
+/************************************************************/
+void initialize(sim_context_t *ctx, char **program_filenames, int num_prog_files) { 
+  int i;
 
+  for ( i = 0; i < num_prog_files; i++ )
+    load_program(ctx, program_filenames[i]);
+  ctx->NEXT_STATE = ctx->CURRENT_STATE;
+    
+  ctx->RUN_BIT = TRUE;
+}
 
+#ifndef SIM_NO_MAIN	/* other drivers (bench.c) bring their own main */
 /***************************************************************/
 /*                                                             */
-/* Procedure: mem_read_32                                      */
+/* Procedure : flag_arity                                      */
 /*                                                             */
-/* Purpose: Read a 32-bit word from memory                     */
+/* Purpose   : Number of values a command-line flag takes, or  */
+/*             -1 if the flag is unknown.                      */
 /*                                                             */
 /***************************************************************/
-uint32_t mem_read_32(uint64_t address)
-{
-    int i;
-    for (i = 0; i < MEM_NREGIONS; i++) {
-        if (address >= MEM_REGIONS[i].start &&
-                address < (MEM_REGIONS[i].start + MEM_REGIONS[i].size)) {
-            uint32_t offset = address - MEM_REGIONS[i].start;
-
-            return
-                (MEM_REGIONS[i].mem[offset+3] << 24) |
-                (MEM_REGIONS[i].mem[offset+2] << 16) |
-                (MEM_REGIONS[i].mem[offset+1] <<  8) |
-                (MEM_REGIONS[i].mem[offset+0] <<  0);
-        }
-    }
-
+int flag_arity(char *flag) {
+  if (strcmp(flag, "--go") == 0 || strcmp(flag, "--rdump") == 0 ||
+      strcmp(flag, "--batch") == 0 || strcmp(flag, "--changed") == 0)
     return 0;
+  if (strcmp(flag, "--cycles") == 0 || strcmp(flag, "--mdump") == 0 ||
+      strcmp(flag, "--engine") == 0 || strcmp(flag, "--jobs") == 0 ||
+      strcmp(flag, "--quantum") == 0 || strcmp(flag, "--sweep") == 0 ||
+      strcmp(flag, "--save") == 0 || strcmp(flag, "--restore") == 0 ||
+      strcmp(flag, "--format") == 0)
+    return 1;
+  return -1;
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure: mem_write_32                                     */
+/* Position in the command-line flags of a run that can be     */
+/* stopped between instructions and picked up later.           */
+/*                                                             */
+/***************************************************************/
+typedef struct {
+  int i;		/* flag being carried out */
+  long long left;	/* instructions left for --go/--cycles, -1 if not started */
+  int changed;		/* --changed seen: later dumps only show changes */
+  int format;		/* DUMP_* of later dumps, from --format */
+  int sweep_row;	/* --rdump/--mdump are CSV columns, not dumps */
+} flag_cursor_t;
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : run_flags_slice                                 */
 /*                                                             */
-/* Purpose: Write a 32-bit word to memory                      */
+/* Purpose   : Carry out the command-line flags from the       */
+/*             cursor on, running at most quantum              */
+/*             instructions. Return TRUE once every flag is    */
+/*             done, FALSE if the quantum ran out first.       */
 /*                                                             */
 /***************************************************************/
-void mem_write_32(uint64_t address, uint32_t value)
-{
-    int i;
-    for (i = 0; i < MEM_NREGIONS; i++) {
-        if (address >= MEM_REGIONS[i].start &&
-                address < (MEM_REGIONS[i].start + MEM_REGIONS[i].size)) {
-            uint32_t offset = address - MEM_REGIONS[i].start;
-
-            MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-            MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-            MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-            MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
-            return;
-        }
+int run_flags_slice(sim_context_t *ctx, FILE * dumpsim_file, int argc, char *argv[],
+                    flag_cursor_t *c, int quantum) {
+  char *value, *end;
+  long long n;
+  int e;
+
+  for (; c->i < argc; c->i++) {
+    if (strncmp(argv[c->i], "--", 2) != 0)
+      continue;
+    value = argv[c->i + 1];
+
+    if (strcmp(argv[c->i], "--go") == 0 || strcmp(argv[c->i], "--cycles") == 0) {
+      if (c->left < 0)
+        c->left = strcmp(argv[c->i], "--go") == 0 ? LLONG_MAX : strtoll(value, NULL, 0);
+      while (ctx->RUN_BIT && c->left > 0) {
+        if (quantum <= 0)
+          return FALSE;
+        n = run_engine(ctx, c->left < quantum ? c->left : quantum);
+        c->left -= n;
+        quantum -= n;
+      }
+      c->left = -1;
+    } else if (c->sweep_row && (strcmp(argv[c->i], "--rdump") == 0 ||
+                                strcmp(argv[c->i], "--mdump") == 0)) {
+      /* sweep_columns reports them once the row is done */
+    } else if (strcmp(argv[c->i], "--rdump") == 0) {
+      rdump(ctx, dumpsim_file, c->changed, c->format);
+    } else if (strcmp(argv[c->i], "--changed") == 0 || strcmp(argv[c->i], "--format") == 0) {
+      if (strcmp(argv[c->i], "--changed") == 0)
+        c->changed = TRUE;
+      else if ((c->format = dump_format(value)) < 0) {
+        printf("Error: Invalid format %s\n", value);
+        exit(1);
+      }
+      if (c->changed && c->format != DUMP_TEXT) {
+        printf("Error: --changed only applies to text dumps\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[c->i], "--mdump") == 0) {
+      n = strtoll(value, &end, 0);
+      if (*end != ':') {
+        printf("Error: --mdump expects low:high, got %s\n", value);
+        exit(1);
+      }
+      mdump(ctx, dumpsim_file, n, strtoll(end + 1, NULL, 0), c->changed, c->format);
+    } else if (strcmp(argv[c->i], "--save") == 0) {
+      save(ctx, value);
+    } else if (strcmp(argv[c->i], "--restore") == 0) {
+      restore(ctx, value);
+    } else if (strcmp(argv[c->i], "--engine") == 0) {
+      for (e = 0; e < N_ENGINES; e++)
+        if (strcmp(value, ENGINE_NAMES[e]) == 0)
+          break;
+      if (e == N_ENGINES) {
+        printf("Error: Invalid engine %s\n", value);
+        exit(1);
+      }
+      ctx->ENGINE = e;
     }
+    c->i += flag_arity(argv[c->i]);
+  }
+  return TRUE;
 }
+
 /***************************************************************/
 /*                                                             */
-/* Procedure : help                                            */
+/* Procedure : run_flags                                       */
 /*                                                             */
-/* Purpose   : Print out a list of commands                    */
+/* Purpose   : Carry out the command-line flags in the order   */
+/*             they were given, like the matching commands     */
+/*             but without progress messages.                  */
 /*                                                             */
 /***************************************************************/
-void help() {                                                    
-  printf("----------------ARM ISIM Help-----------------------\n");
-  printf("go               -  run program to completion         \n");
-  printf("run n            -  execute program for n instructions\n");
-  printf("mdump low high   -  dump memory from low to high      \n");
-  printf("rdump            -  dump the register & bus values    \n");
-  printf("input reg_no reg_value - set GPR reg_no to reg_value  \n");
-  printf("?                -  display this help menu            \n");
-  printf("quit             -  exit the program                  \n\n");
+void run_flags(sim_context_t *ctx, FILE * dumpsim_file, int argc, char *argv[]) {
+  flag_cursor_t c = { 1, -1, FALSE, DUMP_TEXT, FALSE };
+
+  while (!run_flags_slice(ctx, dumpsim_file, argc, argv, &c, INT_MAX))
+    ;
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : cycle                                           */
+/* Batch runs. Every program (or sweep row) is a job with its  */
+/* own sim_context that runs in quanta of BATCH.quantum        */
+/* instructions. Each worker owns a deque of jobs: it takes    */
+/* new jobs from the bottom and puts preempted ones back on    */
+/* top, where idle workers steal from, so short programs drain */
+/* first and long ones spread over the free workers. A worker  */
+/* that finds every deque empty sleeps on BATCH.work until a   */
+/* job is queued or the batch is over. Output is               */
+/* kept in memory and printed in job order once every job is   */
+/* done.                                                       */
 /*                                                             */
-/* Purpose   : Execute a cycle                                 */
+/***************************************************************/
+
+#define BATCH_QUANTUM 1000000	/* default instructions per slice */
+
+typedef struct {
+  int index;		/* program, or sweep row */
+  sim_context_t *ctx;	/* NULL until the job first runs */
+  FILE *dump;
+  flag_cursor_t cursor;
+  char *out_buf, *dump_buf;	/* open_memstream buffers */
+  size_t out_size, dump_size;
+} batch_job_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  batch_job_t **jobs;	/* ring of BATCH.num_jobs entries */
+  int top, count;
+  sim_context_t *spare;	/* context of a finished job, for the next one */
+} batch_worker_t;
+
+struct {
+  char **programs;
+  int sweep;		/* jobs are SWEEP rows instead of programs */
+  int argc;
+  char **argv;
+  int quantum;
+  batch_job_t *jobs;
+  int num_jobs;
+  batch_worker_t *workers;
+  int num_workers;
+  int pending;		/* jobs not finished yet */
+  int queued;		/* jobs waiting in some deque */
+  FILE *null;		/* output of sweep rows, discarded */
+  pthread_mutex_t lock;
+  pthread_cond_t work;	/* a job was queued, or pending reached 0 */
+} BATCH = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER };
+
+/***************************************************************/
+/*                                                             */
+/* Sweep runs. The programs are loaded once and kept as the    */
+/* SWEEP.start snapshot; every row of the sweep file is forked */
+/* from it with some registers set, and reports its final      */
+/* state as one line of a CSV table.                           */
 /*                                                             */
 /***************************************************************/
-void cycle() {                                                
+struct {
+  sim_snapshot_t *start;
+  int *regs;		/* register set by each column */
+  int num_cols;
+  uint64_t *values;	/* num_rows x num_cols */
+  int num_rows;
+} SWEEP;
 
-  process_instruction();
-  CURRENT_STATE = NEXT_STATE;
-  INSTRUCTION_COUNT++;
+/***************************************************************/
+/*                                                             */
+/* Procedure : batch_queued                                    */
+/*                                                             */
+/* Purpose   : Count jobs put in or taken out of the deques,   */
+/*             waking an idle worker for a new one             */
+/*                                                             */
+/***************************************************************/
+void batch_queued(int delta) {
+  pthread_mutex_lock(&BATCH.lock);
+  BATCH.queued += delta;
+  if (delta > 0)
+    pthread_cond_signal(&BATCH.work);
+  pthread_mutex_unlock(&BATCH.lock);
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : run n                                           */
+/* Procedures : deque_push_bottom, deque_push_top,             */
+/*              deque_pop_bottom, deque_steal                  */
 /*                                                             */
-/* Purpose   : Simulate ARM for n cycles                       */
+/* Purpose    : Job deque of a worker. The owner uses both     */
+/*              ends; other workers only take from the top.    */
 /*                                                             */
 /***************************************************************/
-void run(int num_cycles) {                                      
-  int i;
+void deque_push_bottom(batch_worker_t *w, batch_job_t *job) {
+  pthread_mutex_lock(&w->lock);
+  w->jobs[(w->top + w->count++) % BATCH.num_jobs] = job;
+  pthread_mutex_unlock(&w->lock);
+  batch_queued(1);
+}
 
-  if (RUN_BIT == FALSE) {
-    printf("Can't simulate, Simulator is halted\n\n");
-    return;
-  }
+void deque_push_top(batch_worker_t *w, batch_job_t *job) {
+  pthread_mutex_lock(&w->lock);
+  w->top = (w->top + BATCH.num_jobs - 1) % BATCH.num_jobs;
+  w->jobs[w->top] = job;
+  w->count++;
+  pthread_mutex_unlock(&w->lock);
+  batch_queued(1);
+}
 
-  printf("Simulating for %d cycles...\n\n", num_cycles);
-  for (i = 0; i < num_cycles; i++) {
-    if (RUN_BIT == FALSE) {
-	    printf("Simulator halted\n\n");
-	    break;
-    }
-    cycle();
+batch_job_t *deque_pop_bottom(batch_worker_t *w) {
+  batch_job_t *job = NULL;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->count > 0)
+    job = w->jobs[(w->top + --w->count) % BATCH.num_jobs];
+  pthread_mutex_unlock(&w->lock);
+  if (job != NULL)
+    batch_queued(-1);
+  return job;
+}
+
+batch_job_t *deque_steal(batch_worker_t *w) {
+  batch_job_t *job = NULL;
+
+  if (pthread_mutex_trylock(&w->lock) != 0)
+    return NULL;
+  if (w->count > 0) {
+    job = w->jobs[w->top];
+    w->top = (w->top + 1) % BATCH.num_jobs;
+    w->count--;
   }
+  pthread_mutex_unlock(&w->lock);
+  if (job != NULL)
+    batch_queued(-1);
+  return job;
 }
 
-/***************************************************************/ 
+/***************************************************************/
 /*                                                             */
-/* Procedure : mdump                                           */
+/* Procedure : sweep_start                                     */
 /*                                                             */
-/* Purpose   : Dump a word-aligned region of memory to the     */
-/*             output file.                                    */
+/* Purpose   : Fork a context for a sweep row from the loaded  */
+/*             programs and set the row's registers.           */
 /*                                                             */
 /***************************************************************/
-void mdump(FILE * dumpsim_file, int start, int stop) {          
-  int address;
-
-  printf("\nMemory content [0x%08x..0x%08x] :\n", start, stop);
-  printf("-------------------------------------\n");
-  for (address = start; address <= stop; address += 4)
-    printf("  0x%08x (%d) : 0x%x\n", address, address, mem_read_32(address));
-  printf("\n");
+void sweep_start(sim_context_t *ctx, int row) {
+  int col;
 
-  /* dump the memory contents into the dumpsim file */
-  fprintf(dumpsim_file, "\nMemory content [0x%08x..0x%08x] :\n", start, stop);
-  fprintf(dumpsim_file, "-------------------------------------\n");
-  for (address = start; address <= stop; address += 4)
-    fprintf(dumpsim_file, "  0x%08x (%d) : 0x%x\n", address, address, mem_read_32(address));
-  fprintf(dumpsim_file, "\n");
+  sim_snapshot_fork(SWEEP.start, ctx);
+  for (col = 0; col < SWEEP.num_cols; col++)
+    ctx->CURRENT_STATE.REGS[SWEEP.regs[col]] = SWEEP.values[row * SWEEP.num_cols + col];
+  ctx->NEXT_STATE = ctx->CURRENT_STATE;
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : rdump                                           */
+/* Procedure : sweep_columns                                   */
 /*                                                             */
-/* Purpose   : Dump current register and bus values to the     */   
-/*             output file.                                    */
+/* Purpose   : Write one row's final state as a line of the    */
+/*             results table: instruction count, PC,           */
+/*             registers, flags and the words of every         */
+/*             --mdump range. With no ctx, write the header.   */
 /*                                                             */
 /***************************************************************/
-void rdump(FILE * dumpsim_file) {                               
-  int k; 
+void sweep_columns(sim_context_t *ctx, int row, FILE *f) {
+  char *end;
+  uint64_t lo, hi, address;
+  int i, k;
 
-  printf("\nCurrent register/bus values :\n");
-  printf("-------------------------------------\n");
-  printf("Instruction Count : %u\n", INSTRUCTION_COUNT);
-  printf("PC                : 0x%" PRIx64 "\n", CURRENT_STATE.PC);
-  printf("Registers:\n");
+  if (ctx == NULL)
+    fprintf(f, "row,instructions,PC");
+  else
+    fprintf(f, "%d,%u,0x%" PRIx64, row + 1, ctx->INSTRUCTION_COUNT, ctx->CURRENT_STATE.PC);
   for (k = 0; k < ARM_REGS; k++)
-    printf("X%d: 0x%" PRIx64 "\n", k, CURRENT_STATE.REGS[k]);
-  printf("FLAG_N: %d\n", CURRENT_STATE.FLAG_N);
-  printf("FLAG_Z: %d\n", CURRENT_STATE.FLAG_Z);
-  printf("\n");
+    if (ctx == NULL)
+      fprintf(f, ",X%d", k);
+    else
+      fprintf(f, ",0x%" PRIx64, ctx->CURRENT_STATE.REGS[k]);
+  if (ctx == NULL)
+    fprintf(f, ",FLAG_N,FLAG_Z");
+  else
+    fprintf(f, ",%d,%d", ctx->CURRENT_STATE.FLAG_N, ctx->CURRENT_STATE.FLAG_Z);
 
-  /* dump the state information into the dumpsim file */
-  fprintf(dumpsim_file, "\nCurrent register/bus values :\n");
-  fprintf(dumpsim_file, "-------------------------------------\n");
-  fprintf(dumpsim_file, "Instruction Count : %u\n", INSTRUCTION_COUNT);
-  fprintf(dumpsim_file, "PC                : 0x%" PRIx64 "\n", CURRENT_STATE.PC);
-  fprintf(dumpsim_file, "Registers:\n");
-  for (k = 0; k < ARM_REGS; k++)
-    fprintf(dumpsim_file, "X%d: 0x%" PRIx64 "\n", k, CURRENT_STATE.REGS[k]);
-  fprintf(dumpsim_file, "FLAG_N: %d\n", CURRENT_STATE.FLAG_N);
-  fprintf(dumpsim_file, "FLAG_Z: %d\n", CURRENT_STATE.FLAG_Z);
-  fprintf(dumpsim_file, "\n");
+  for (i = 1; i < BATCH.argc; i++) {
+    if (strcmp(BATCH.argv[i], "--mdump") != 0)
+      continue;
+    lo = strtoll(BATCH.argv[i + 1], &end, 0);
+    hi = strtoll(end + 1, NULL, 0);
+    for (address = lo; address <= hi; address += 4)
+      if (ctx == NULL)
+        fprintf(f, ",0x%08" PRIx64, address);
+      else
+        fprintf(f, ",0x%x", mem_read_32(ctx, address));
+  }
+  fprintf(f, "\n");
 }
+
 /***************************************************************/
 /*                                                             */
-/* Procedure : go                                              */
+/* Procedure : batch_slice                                     */
 /*                                                             */
-/* Purpose   : Simulate ARM until HALTed                       */
+/* Purpose   : Run one quantum of a job, starting it on a      */
+/*             fresh machine the first time. Return TRUE once  */
+/*             the job is finished.                            */
 /*                                                             */
 /***************************************************************/
-void go(FILE * dumpsim_file) {                                                     
-  if (RUN_BIT == FALSE) {
-    printf("Can't simulate, Simulator is halted\n\n");
-    return;
+int batch_slice(batch_worker_t *w, batch_job_t *job) {
+  char *program;
+
+  if (job->ctx == NULL) {
+    if (w->spare != NULL) {
+      job->ctx = w->spare;
+      w->spare = NULL;
+      sim_context_reset(job->ctx);
+      mem_forget_dumps(job->ctx);
+      /* the engine the last job picked with --engine */
+      job->ctx->ENGINE = ENGINE_INTERP;
+    } else
+      job->ctx = sim_context_create();
+
+    if (BATCH.sweep) {
+      job->ctx->out = job->dump = BATCH.null;
+      sweep_start(job->ctx, job->index);
+    } else {
+      program = BATCH.programs[job->index];
+      job->ctx->out = open_memstream(&job->out_buf, &job->out_size);
+      job->dump = open_memstream(&job->dump_buf, &job->dump_size);
+      assert(job->ctx->out != NULL && job->dump != NULL);
+
+      initialize(job->ctx, &program, 1);
+      fprintf(job->ctx->out, "==> %s <==\n", program);
+      fprintf(job->dump, "==> %s <==\n", program);
+    }
+    job->cursor.i = 1;
+    job->cursor.left = -1;
+    job->cursor.changed = FALSE;
+    job->cursor.format = DUMP_TEXT;
+    job->cursor.sweep_row = BATCH.sweep;
   }
 
-  printf("Simulating...\n\n");
-  while (RUN_BIT) {
-    cycle();
-    //printf("Going\n");
-    //rdump(dumpsim_file);
-    //mdump(dumpsim_file, MEM_DATA_START, MEM_DATA_START+0x100);
+  if (!run_flags_slice(job->ctx, job->dump, BATCH.argc, BATCH.argv,
+                       &job->cursor, BATCH.quantum))
+    return FALSE;
+
+  if (BATCH.sweep) {
+    job->ctx->out = open_memstream(&job->out_buf, &job->out_size);
+    assert(job->ctx->out != NULL);
+    sweep_columns(job->ctx, job->index, job->ctx->out);
+    fclose(job->ctx->out);
+  } else {
+    fclose(job->ctx->out);
+    fclose(job->dump);
   }
-  printf("Simulator halted\n\n");
+  if (w->spare == NULL)
+    w->spare = job->ctx;
+  else
+    sim_context_destroy(job->ctx);
+  job->ctx = NULL;
+  return TRUE;
 }
 
-
 /***************************************************************/
 /*                                                             */
-/* Procedure : get_command                                     */
+/* Procedure : batch_worker                                    */
 /*                                                             */
-/* Purpose   : Read a command from standard input.             */  
+/* Purpose   : Run jobs from the worker's own deque, or stolen */
+/*             from the others, until every job is finished.   */
 /*                                                             */
 /***************************************************************/
-void get_command(FILE * dumpsim_file) {                         
-  char buffer[20];
-  int start, stop, cycles;
-  int register_no;
-  int64_t register_value;
+void *batch_worker(void *arg) {
+  batch_worker_t *w = arg;
+  batch_job_t *job;
+  int i, self = w - BATCH.workers;
 
-  printf("ARM-SIM> ");
+  for (;;) {
+    job = deque_pop_bottom(w);
+    for (i = 1; job == NULL && i < BATCH.num_workers; i++)
+      job = deque_steal(&BATCH.workers[(self + i) % BATCH.num_workers]);
 
-  if (scanf("%s", buffer) == EOF)
-      exit(0);
+    if (job == NULL) {
+      /* queued but not taken yet means another try, not a wait */
+      pthread_mutex_lock(&BATCH.lock);
+      while (BATCH.pending > 0 && BATCH.queued == 0)
+        pthread_cond_wait(&BATCH.work, &BATCH.lock);
+      i = BATCH.pending;
+      pthread_mutex_unlock(&BATCH.lock);
+      if (i == 0)
+        break;
+      continue;
+    }
 
-  printf("\n");
+    if (batch_slice(w, job)) {
+      pthread_mutex_lock(&BATCH.lock);
+      if (--BATCH.pending == 0)
+        pthread_cond_broadcast(&BATCH.work);
+      pthread_mutex_unlock(&BATCH.lock);
+    } else
+      deque_push_top(w, job);
+  }
 
-  switch(buffer[0]) {
-  case 'G':
-  case 'g':
-    go(dumpsim_file);
-    break;
+  if (w->spare != NULL)
+    sim_context_destroy(w->spare);
+  return NULL;
+}
 
-  case 'M':
-  case 'm':
-    if (scanf("%i %i", &start, &stop) != 2)
-        break;
+/***************************************************************/
+/*                                                             */
+/* Procedure : run_jobs                                        */
+/*                                                             */
+/* Purpose   : Run num_jobs jobs on jobs threads, leaving their */
+/*             output in BATCH.jobs.                           */
+/*                                                             */
+/***************************************************************/
+void run_jobs(int num_jobs, int jobs, int quantum, int argc, char *argv[]) {
+  pthread_t *threads;
+  batch_worker_t *w;
+  int i;
 
-    mdump(dumpsim_file, start, stop);
-    break;
+  if (jobs > num_jobs)
+    jobs = num_jobs;
 
-  case '?':
-    help();
-    break;
+  BATCH.argc = argc;
+  BATCH.argv = argv;
+  BATCH.quantum = quantum;
+  BATCH.jobs = calloc(num_jobs, sizeof(batch_job_t));
+  BATCH.num_jobs = num_jobs;
+  BATCH.workers = calloc(jobs, sizeof(batch_worker_t));
+  BATCH.num_workers = jobs;
+  BATCH.pending = num_jobs;
+  BATCH.queued = 0;
+  threads = malloc(jobs * sizeof(pthread_t));
+  assert(BATCH.jobs != NULL && BATCH.workers != NULL && threads != NULL);
 
-  case 'Q':
-  case 'q':
-    printf("Bye.\n");
-    exit(0);
+  for (i = 0; i < jobs; i++) {
+    w = &BATCH.workers[i];
+    pthread_mutex_init(&w->lock, NULL);
+    w->jobs = malloc(num_jobs * sizeof(batch_job_t *));
+    assert(w->jobs != NULL);
+  }
+  /* dealt in reverse so each worker pops its jobs in order */
+  for (i = num_jobs - 1; i >= 0; i--) {
+    BATCH.jobs[i].index = i;
+    deque_push_bottom(&BATCH.workers[i % jobs], &BATCH.jobs[i]);
+  }
 
-  case 'R':
-  case 'r':
-    if (buffer[1] == 'd' || buffer[1] == 'D')
-	    rdump(dumpsim_file);
-    else {
-	    if (scanf("%d", &cycles) != 1) break;
-	    run(cycles);
+  for (i = 1; i < jobs; i++)
+    if (pthread_create(&threads[i], NULL, batch_worker, &BATCH.workers[i]) != 0) {
+      printf("Error: Can't start batch worker\n");
+      exit(-1);
     }
-    break;
-
-  case 'I':
-  case 'i':
-   if (scanf("%i %" PRIx64, &register_no, &register_value) != 2)
-      break;
-   CURRENT_STATE.REGS[register_no] = register_value;
-   NEXT_STATE.REGS[register_no] = register_value;
-   break;
+  batch_worker(&BATCH.workers[0]);
+  for (i = 1; i < jobs; i++)
+    pthread_join(threads[i], NULL);
 
-  default:
-    printf("Invalid Command\n");
-    break;
+  for (i = 0; i < jobs; i++) {
+    pthread_mutex_destroy(&BATCH.workers[i].lock);
+    free(BATCH.workers[i].jobs);
   }
+  free(BATCH.workers);
+  free(threads);
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : init_memory                                     */
+/* Procedure : run_batch                                       */
 /*                                                             */
-/* Purpose   : Allocate and zero memory                        */
+/* Purpose   : Simulate each program on its own, from a fresh  */
+/*             machine, running the flags for every one, on    */
+/*             jobs threads.                                   */
 /*                                                             */
 /***************************************************************/
-void init_memory() {                                           
-    int i;
-    for (i = 0; i < MEM_NREGIONS; i++) {
-        // Extra 3 bytes to prevent buffer overflow on unaligned access.
-        MEM_REGIONS[i].mem = malloc(MEM_REGIONS[i].size + 3);
-        memset(MEM_REGIONS[i].mem, 0, MEM_REGIONS[i].size);
-    }
-}
+void run_batch(FILE * dumpsim_file, char **programs, int num_programs,
+               int jobs, int quantum, int argc, char *argv[]) {
+  int i;
 
-/**************************************************************/
-/*                                                            */
-/* Procedure : load_program                                   */
-/*                                                            */
-/* Purpose   : Load program and service routines into mem.    */
-/*                                                            */
-/**************************************************************/
-void load_program(char *program_filename) {                   
-  FILE * prog;
-  int ii, word;
+  BATCH.programs = programs;
+  run_jobs(num_programs, jobs, quantum, argc, argv);
 
-  /* Open program file. */
-  prog = fopen(program_filename, "r");
-  if (prog == NULL) {
-    printf("Error: Can't open program file %s\n", program_filename);
-    exit(-1);
+  for (i = 0; i < num_programs; i++) {
+    fwrite(BATCH.jobs[i].out_buf, 1, BATCH.jobs[i].out_size, stdout);
+    fwrite(BATCH.jobs[i].dump_buf, 1, BATCH.jobs[i].dump_size, dumpsim_file);
+    free(BATCH.jobs[i].out_buf);
+    free(BATCH.jobs[i].dump_buf);
   }
+  free(BATCH.jobs);
+}
 
-  /* Read in the program. */
+/***************************************************************/
+/*                                                             */
+/* Procedure : load_sweep                                      */
+/*                                                             */
+/* Purpose   : Read a sweep file: a CSV whose header names the */
+/*             registers to set (X0..X30) and whose rows give  */
+/*             their initial values, decimal or 0x hex.        */
+/*                                                             */
+/***************************************************************/
+void load_sweep(char *filename) {
+  FILE *f;
+  char *line = NULL, *p, *end;
+  size_t size = 0;
+  int col, line_no = 0, max_rows = 0;
+  long reg;
 
-  ii = 0;
-  int bytes_read = EOF;
-  while ((bytes_read=fscanf(prog, "%x\n", &word)) > 0) {
-    mem_write_32(MEM_TEXT_START + ii, word);
-    ii += 4;
-  }
-  if (bytes_read == 0) {
-    printf("Error: Malformed program file %s\n", program_filename);
+  if ((f = fopen(filename, "r")) == NULL) {
+    printf("Error: Can't open sweep file %s\n", filename);
     exit(-1);
   }
 
-  CURRENT_STATE.PC = MEM_TEXT_START;
+  while (getline(&line, &size, f) != -1) {
+    line_no++;
+    line[strcspn(line, "\r\n")] = '\0';
+    for (p = line; *p == ' ' || *p == '\t'; p++)
+      ;
+    if (*p == '\0')
+      continue;
+
+    if (SWEEP.regs == NULL) {
+      /* header */
+      SWEEP.regs = malloc((strlen(line) / 2 + 1) * sizeof(int));
+      assert(SWEEP.regs != NULL);
+      for (;;) {
+        while (*p == ' ')
+          p++;
+        if (*p != 'X' && *p != 'x')
+          break;
+        reg = strtol(p + 1, &end, 10);
+        if (end == p + 1 || reg < 0 || reg >= ARM_REGS - 1)
+          break;
+        SWEEP.regs[SWEEP.num_cols++] = reg;
+        for (p = end; *p == ' '; p++)
+          ;
+        if (*p != ',')
+          break;
+        p++;
+      }
+      if (*p != '\0') {
+        printf("Error: %s:%d: expected register names X0..X30\n", filename, line_no);
+        exit(1);
+      }
+      continue;
+    }
 
-  printf("Read %d words from program into memory.\n\n", ii/4);
+    if (SWEEP.num_rows == max_rows) {
+      max_rows = max_rows ? 2 * max_rows : 64;
+      SWEEP.values = realloc(SWEEP.values, max_rows * SWEEP.num_cols * sizeof(uint64_t));
+      assert(SWEEP.values != NULL);
+    }
+    for (col = 0; col < SWEEP.num_cols; col++) {
+      SWEEP.values[SWEEP.num_rows * SWEEP.num_cols + col] = strtoull(p, &end, 0);
+      while (*end == ' ')
+        end++;
+      if (end == p || *end != (col == SWEEP.num_cols - 1 ? '\0' : ',')) {
+        printf("Error: %s:%d: expected %d values\n", filename, line_no, SWEEP.num_cols);
+        exit(1);
+      }
+      p = end + 1;
+    }
+    SWEEP.num_rows++;
+  }
+  free(line);
+  fclose(f);
 }
 
-/************************************************************/
-/*                                                          */
-/* Procedure : initialize                                   */
-/*                                                          */
-/* Purpose   : Load machine language program                */ 
-/*             and set up initial state of the machine.     */
-/*                                                          */
-/************************************************************/
-void initialize(char *program_filename, int num_prog_files) { 
+/***************************************************************/
+/*                                                             */
+/* Procedure : run_sweep                                       */
+/*                                                             */
+/* Purpose   : Load the programs once and run them for every   */
+/*             row of the sweep file on jobs threads; print    */
+/*             the final states as a CSV table to stdout and   */
+/*             the dumpsim file.                               */
+/*                                                             */
+/***************************************************************/
+void run_sweep(FILE * dumpsim_file, char *sweep_file, char **programs, int num_programs,
+               int jobs, int quantum, int argc, char *argv[]) {
+  sim_context_t *ctx;
+  char *end;
   int i;
 
-  init_memory();
-  for ( i = 0; i < num_prog_files; i++ ) {
-    load_program(program_filename);
-    while(*program_filename++ != '\0');
+  /* the rows don't run --mdump, sweep_columns reads it */
+  for (i = 1; i < argc; i++)
+    if (strcmp(argv[i], "--mdump") == 0) {
+      strtoll(argv[i + 1], &end, 0);
+      if (*end != ':') {
+        printf("Error: --mdump expects low:high, got %s\n", argv[i + 1]);
+        exit(1);
+      }
+    }
+  load_sweep(sweep_file);
+  ctx = sim_context_create();
+  initialize(ctx, programs, num_programs);
+  SWEEP.start = sim_snapshot_take(ctx);
+  sim_context_destroy(ctx);
+
+  BATCH.sweep = TRUE;
+  if ((BATCH.null = fopen("/dev/null", "w")) == NULL) {
+    printf("Error: Can't open /dev/null\n");
+    exit(-1);
   }
-  NEXT_STATE = CURRENT_STATE;
-    
-  RUN_BIT = TRUE;
+  BATCH.argc = argc;
+  BATCH.argv = argv;
+  if (SWEEP.num_rows > 0)
+    run_jobs(SWEEP.num_rows, jobs, quantum, argc, argv);
+
+  sweep_columns(NULL, 0, stdout);
+  sweep_columns(NULL, 0, dumpsim_file);
+  for (i = 0; i < SWEEP.num_rows; i++) {
+    fwrite(BATCH.jobs[i].out_buf, 1, BATCH.jobs[i].out_size, stdout);
+    fwrite(BATCH.jobs[i].out_buf, 1, BATCH.jobs[i].out_size, dumpsim_file);
+    free(BATCH.jobs[i].out_buf);
+  }
+  free(BATCH.jobs);
+  fclose(BATCH.null);
+  sim_snapshot_release(SWEEP.start);
+  free(SWEEP.regs);
+  free(SWEEP.values);
 }
 
 /***************************************************************/
 /*                                                             */
 /* Procedure : main                                            */
 /*                                                             */
+/* Purpose   : With no flags, load the programs and read       */
+/*             commands from stdin. With flags (--go,          */
+/*             --cycles n, --rdump, --mdump lo:hi,             */
+/*             --engine name, --save file, --restore file) run */
+/*             them in order and exit.                         */
+/*             --batch runs them once per program file instead */
+/*             of loading all the files together; --jobs n     */
+/*             does so on n threads (0: one per CPU), handing  */
+/*             out --quantum n instructions at a time.         */
+/*             --sweep file runs the programs once per row of  */
+/*             initial register values and prints a CSV table  */
+/*             of final states instead of the dumps.           */
+/*                                                             */
 /***************************************************************/
 int main(int argc, char *argv[]) {                              
+  sim_context_t *ctx;
   FILE * dumpsim_file;
+  char **programs, *sweep = NULL, *state_flag = NULL;
+  int i, arity, batch = FALSE, jobs = 1, quantum = BATCH_QUANTUM;
+  int num_programs = 0;
+
+  programs = malloc(argc * sizeof(char *));
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) != 0) {
+      programs[num_programs++] = argv[i];
+      continue;
+    }
+    arity = flag_arity(argv[i]);
+    if (arity < 0 || i + arity >= argc) {
+      printf("Error: Unknown flag or missing value: %s\n", argv[i]);
+      exit(1);
+    }
+    HEADLESS = TRUE;
+    if (strcmp(argv[i], "--batch") == 0)
+      batch = TRUE;
+    if (strcmp(argv[i], "--sweep") == 0)
+      sweep = argv[i + 1];
+    if (strcmp(argv[i], "--save") == 0 || strcmp(argv[i], "--restore") == 0)
+      state_flag = argv[i];
+    if (strcmp(argv[i], "--jobs") == 0) {
+      batch = TRUE;
+      jobs = atoi(argv[i + 1]);
+      if (jobs <= 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (strcmp(argv[i], "--quantum") == 0) {
+      quantum = atoi(argv[i + 1]);
+      if (quantum <= 0) {
+        printf("Error: --quantum expects a positive count\n");
+        exit(1);
+      }
+    }
+    i += arity;
+  }
 
   /* Error Checking */
-  if (argc < 2) {
-    printf("Error: usage: %s <program_file_1> <program_file_2> ...\n",
+  if (num_programs < 1) {
+    printf("Error: usage: %s [--go] [--cycles n] [--rdump] [--mdump lo:hi]\n"
+           "       [--changed] [--format text|json|bin] [--engine name]\n"
+           "       [--batch] [--jobs n] [--quantum n] [--sweep file.csv]\n"
+           "       [--save file] [--restore file]\n"
+           "       <program_file_1> <program_file_2> ...\n",
            argv[0]);
     exit(1);
   }
 
-  printf("ARM Simulator\n\n");
+  /* every job would write or replace its state from the same file */
+  if ((batch || sweep != NULL) && state_flag != NULL) {
+    printf("Error: %s can't be used with --batch, --jobs or --sweep\n", state_flag);
+    exit(1);
+  }
 
-  initialize(argv[1], argc - 1);
+  if (!HEADLESS)
+    printf("ARM Simulator\n\n");
 
   if ( (dumpsim_file = fopen( "dumpsim", "w" )) == NULL ) {
     printf("Error: Can't open dumpsim file\n");
     exit(-1);
   }
 
+  if (sweep != NULL) {
+    run_sweep(dumpsim_file, sweep, programs, num_programs, jobs, quantum, argc, argv);
+    fclose(dumpsim_file);
+    return 0;
+  }
+
+  if (batch) {
+    run_batch(dumpsim_file, programs, num_programs, jobs, quantum, argc, argv);
+    fclose(dumpsim_file);
+    return 0;
+  }
+
+  ctx = sim_context_create();
+  initialize(ctx, programs, num_programs);
+
+  if (HEADLESS) {
+    run_flags(ctx, dumpsim_file, argc, argv);
+    sim_context_destroy(ctx);
+    fclose(dumpsim_file);
+    return 0;
+  }
+
   while (1)
-    get_command(dumpsim_file);
+    get_command(ctx, dumpsim_file);
 }
+#endif
@@ -7,20 +7,24 @@
 /*                                                             */
 /***************************************************************/
 
-/* !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!! */
-/*          DO NOT MODIFY THIS FILE!                            */
-/*          You should only change sim.c!                       */
-/* !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!! */
-
 #ifndef _SIM_SHELL_H_
 #define _SIM_SHELL_H_
 
+#include <stdio.h>
 #include <inttypes.h>
 #define FALSE 0
 #define TRUE  1
 
 #define ARM_REGS 32
 
+/* Main memory layout */
+#define MEM_DATA_START  0x10000000
+#define MEM_DATA_SIZE   0x00100000
+#define MEM_TEXT_START  0x00400000
+#define MEM_TEXT_SIZE   0x00100000
+#define MEM_STACK_START 0xfffffffc
+#define MEM_STACK_SIZE  0x00100000
+
 typedef struct CPU_State_Struct {
   uint64_t PC;		          /* program counter */
   int64_t REGS[ARM_REGS];   /* register file. */
@@ -28,16 +32,72 @@ typedef struct CPU_State_Struct {
   int FLAG_Z;               /* flag Z */
 } CPU_State;
 
-/* Data Structure for Latch */
+/* Execution engines */
+#define ENGINE_INTERP 0   /* cycle() / process_instruction() */
+#define ENGINE_BLOCK  1   /* chained basic blocks */
+#define ENGINE_JIT    2   /* basic blocks, hot ones compiled to x86-64 */
+#define ENGINE_THREADED 3 /* direct-threaded (computed goto) interpreter */
+
+/* One simulation: everything a program run owns. Independent contexts
+   share nothing and can run on different threads at the same time. */
+typedef struct sim_context {
+  /* Data Structure for Latch */
+  CPU_State CURRENT_STATE, NEXT_STATE;
+  CPU_State DUMPED_STATE;	/* registers as rdump --changed last showed them */
+  int RUN_BIT;	/* run bit */
+  int INSTRUCTION_COUNT;
+  int ENGINE;	/* selected engine */
+  FILE *out;	/* where go/run/rdump/mdump print (stdout) */
+  struct sim_memory *mem;	/* guest memory (shell.c) */
+  struct sim_engines *engines;	/* decoded text, blocks, JIT code (sim.c) */
+  struct sim_recording *record;	/* checkpoints for rstep/rgo, or NULL */
+} sim_context_t;
+
+sim_context_t *sim_context_create(void);
+void sim_context_destroy(sim_context_t *ctx);
+/* Back to power-on: zero registers and memory, keeping the allocations */
+void sim_context_reset(sim_context_t *ctx);
 
-extern CPU_State CURRENT_STATE, NEXT_STATE;
+/*
+ * Copy-on-write checkpoints. A snapshot keeps the CPU state and memory of
+ * a context; any number of contexts can be forked from it, even from
+ * different threads, and share its pages until they write them.
+ */
+typedef struct sim_snapshot sim_snapshot_t;
+sim_snapshot_t *sim_snapshot_take(sim_context_t *ctx);
+void sim_snapshot_fork(sim_snapshot_t *snap, sim_context_t *ctx);
+void sim_snapshot_release(sim_snapshot_t *snap);
 
-extern int RUN_BIT;	/* run bit */
+/* save/restore: the state as a versioned file whose pages are mapped back
+   in place. Save returns FALSE and load NULL on failure. */
+int sim_context_save(sim_context_t *ctx, const char *filename);
+sim_snapshot_t *sim_snapshot_load(const char *filename);
 
-uint32_t mem_read_32(uint64_t address);
-void     mem_write_32(uint64_t address, uint32_t value);
+uint8_t  mem_read_8(sim_context_t *ctx, uint64_t address);
+uint16_t mem_read_16(sim_context_t *ctx, uint64_t address);
+uint32_t mem_read_32(sim_context_t *ctx, uint64_t address);
+uint64_t mem_read_64(sim_context_t *ctx, uint64_t address);
+void     mem_write_8(sim_context_t *ctx, uint64_t address, uint8_t value);
+void     mem_write_16(sim_context_t *ctx, uint64_t address, uint16_t value);
+void     mem_write_32(sim_context_t *ctx, uint64_t address, uint32_t value);
+void     mem_write_64(sim_context_t *ctx, uint64_t address, uint64_t value);
+void     mem_write_block(sim_context_t *ctx, uint64_t address, const void *src, uint64_t size);
+/* Hash of the contents of [address, address + size) */
+uint64_t mem_hash(sim_context_t *ctx, uint64_t address, uint64_t size);
 
 /* YOU IMPLEMENT THIS FUNCTION */
-void process_instruction();
+void process_instruction(sim_context_t *ctx);
+
+/* Run up to max_insts instructions with a non-interp ENGINE, in place on
+   CURRENT_STATE; returns how many were executed */
+int process_instructions(sim_context_t *ctx, int max_insts);
+
+/* Drop any pre-decoded copy of the text word(s) touched at address */
+void decode_cache_invalidate(sim_context_t *ctx, uint64_t address);
+
+/* Per-context engine state, allocated by sim_context_create */
+struct sim_engines *engines_create(void);
+void engines_destroy(struct sim_engines *engines);
+void engines_reset(struct sim_engines *engines);
 
 #endif
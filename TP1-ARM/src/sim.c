@@ -1,354 +1,929 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 #include "shell.h"
+#include "sim.h"
+#include "trace.h"
+
+/*
+ * Decodificacion por tabla
+ *
+ * Cada instruccion soportada se describe con un par mask/match sobre la
+ * palabra de 32 bits, el formato de sus operandos y el handler que la
+ * ejecuta. A partir de esa lista se genera DECODE_TABLE, indexada por los
+ * 11 bits altos (bits 31..21), que apunta al primer candidato posible. Las
+ * codificaciones irregulares (B.cond, B, MOVZ, LSL/LSR, BR) se resuelven
+ * verificando la mascara completa.
+ */
+
+typedef enum {
+    FMT_NONE,
+    FMT_R,      // Rd, Rn, Rm
+    FMT_I,      // Rd, Rn, imm12 {, LSL #12}
+    FMT_D,      // Rt, [Rn, simm9]
+    FMT_B,      // imm26
+    FMT_CB,     // imm19, cond
+    FMT_IW,     // Rd, imm16 {, LSL #hw*16}
+    FMT_BR,     // Rn
+    FMT_LSL,    // Rd, Rn, #(63 - imms)
+    FMT_LSR,    // Rd, Rn, #immr
+} inst_format_t;
+
+typedef struct {
+    uint32_t mask;
+    uint32_t match;
+    inst_op_t op;
+    inst_format_t format;
+    uint8_t flags;
+    inst_handler_t handler;
+} inst_spec_t;
+
+// Lectura de registro con XZR (X31 siempre vale 0)
+static inline int64_t read_reg(const CPU_State *s, uint32_t r)
+{
+    return (r == 31) ? 0 : s->REGS[r];
+}
 
-void process_instruction()
-{
-    uint32_t instruction = mem_read_32(CURRENT_STATE.PC);
-    uint32_t opcode = (instruction >> 21) & 0x7FF;
-    uint32_t opcode_high = (instruction >> 24) & 0xFF;  // Los 8 bits más altos
-    
-    printf("PC: 0x%016lX | Instruction: 0x%08X | Opcode: 0x%X\n", 
-       (unsigned long) CURRENT_STATE.PC, instruction, opcode);
-    printf("Instrucción: 0x%08X, opcode_high: 0x%X, primeros 8 bits: 0x%X\n", 
-       instruction, opcode_high, instruction >> 24);
-
-    // Caso especial para instrucciones B.Cond (comienzan con 0x54)
-    if (opcode_high == 0x54) {
-        int flag_n = CURRENT_STATE.FLAG_N;
-        int flag_z = CURRENT_STATE.FLAG_Z;
-        uint8_t cond = instruction & 0xF;
-        int32_t imm19 = (instruction >> 5) & 0x7FFFF;  // Inmediato de 19 bits
-    
-        // Extensión de signo del inmediato
-        if (imm19 & (1 << 18)) {
-            imm19 |= ~((1 << 19) - 1);
-        }
-        imm19 <<= 2;
-    
-        uint64_t new_address = CURRENT_STATE.PC + imm19;
-    
-        printf("B.Cond | cond: 0x%X | flag_n: %d | flag_z: %d | imm19: 0x%X | new_address: 0x%016lX\n", 
-               cond, flag_n, flag_z, imm19, new_address);
-    
-        int should_branch = 0;
-        switch (cond) {
-            case 0x0: // BEQ
-                should_branch = (flag_z == 1);
-                break;
-            case 0x1: // BNE
-                should_branch = (flag_z == 0);
-                break;
-            case 0xC: // BGT
-                should_branch = (flag_z == 0 && flag_n == 0);
-                break;
-            case 0xB: // BLT
-                should_branch = (flag_n == 1);
-                break;
-            case 0xA: // BGE
-                should_branch = (flag_n == 0);
-                break;
-            case 0xD: // BLE
-                should_branch = (flag_z == 1 || flag_n == 1);
-                break;
-            default:
-                printf("B.Cond: Unknown condition 0x%X\n", cond);
-                NEXT_STATE.PC = CURRENT_STATE.PC + 4;
-                return;
-        }
-    
-        if (should_branch) {
-            printf("B.Cond: Jumping to address 0x%016lX\n", new_address);
-            NEXT_STATE.PC = new_address;
-        } else {
-            printf("B.Cond: Not jumping\n");
-            NEXT_STATE.PC = CURRENT_STATE.PC + 4;
-        }
-        
-        return;
-    } else {
-        // Switch regular para el resto de instrucciones
-        switch (opcode) {
-            case 0x6A2:  // HLT
-                RUN_BIT = FALSE;  // Detener simulación
-                break;
+// Escritura de registro; las escrituras a XZR se descartan
+static inline void write_reg(CPU_State *s, uint32_t r, int64_t value)
+{
+    s->REGS[r] = (r == 31) ? 0 : value;
+}
 
-            case 0x558: {  // ADDS Register
-                uint32_t Rd = instruction & 0x1F;
-                uint32_t Rn = (instruction >> 5) & 0x1F; 
-                uint32_t Rm = (instruction >> 16) & 0x1F; 
+static inline void set_flags(CPU_State *s, int64_t result)
+{
+    s->FLAG_Z = (result == 0) ? 1 : 0;
+    s->FLAG_N = (result < 0) ? 1 : 0;
+}
 
-                int64_t reg_Xn = (Rn == 31) ? 0 : CURRENT_STATE.REGS[Rn];  // Manejo de XZR
-                int64_t reg_Xm = (Rm == 31) ? 0 : CURRENT_STATE.REGS[Rm];
+static void exec_hlt(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    ctx->RUN_BIT = FALSE;  // Detener simulación
+}
 
-                int64_t result = reg_Xn + reg_Xm;
-                NEXT_STATE.REGS[Rd] = (Rd == 31) ? 0 : result;  // XZR permanece en 0
+static void exec_adds(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)  // ADDS Register
+{
+    int64_t result = read_reg(s, d->rn) + read_reg(s, d->rm);
+    write_reg(s, d->rd, result);
+    set_flags(s, result);
+}
 
-                NEXT_STATE.FLAG_Z = (result == 0) ? 1 : 0;
-                NEXT_STATE.FLAG_N = (result < 0) ? 1 : 0;
-                break;
-            }
+// SUBS Register (también implementa CMP Register cuando Rd=31/XZR)
+static void exec_subs(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    int64_t result = read_reg(s, d->rn) - read_reg(s, d->rm);
+    write_reg(s, d->rd, result);
+    set_flags(s, result);
+}
 
-            case 0x758: {  // SUBS Register (también implementa CMP Register cuando Rd=31/XZR)
-                uint32_t Rd = instruction & 0x1F;
-                uint32_t Rn = (instruction >> 5) & 0x1F;
-                uint32_t Rm = (instruction >> 16) & 0x1F;
-                
-                int64_t reg_Xn = (Rn == 31) ? 0 : CURRENT_STATE.REGS[Rn];
-                int64_t reg_Xm = (Rm == 31) ? 0 : CURRENT_STATE.REGS[Rm];
-                int64_t result = reg_Xn - reg_Xm;
-                
-                NEXT_STATE.REGS[Rd] = (Rd == 31) ? 0 : result;
-                
-                // Actualizar FLAGS
-                NEXT_STATE.FLAG_Z = (result == 0) ? 1 : 0;
-                NEXT_STATE.FLAG_N = (result < 0) ? 1 : 0;
-                break;
-            }
-            
-            case 0x588: {  // ADDS Immediate
-                uint32_t Rd = instruction & 0x1F;
-                uint32_t Rn = (instruction >> 5) & 0x1F;
-                uint32_t imm12 = (instruction >> 10) & 0xFFF;
+static void exec_adds_imm(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    int64_t result = read_reg(s, d->rn) + d->imm;
+    write_reg(s, d->rd, result);
+    set_flags(s, result);
+}
 
-                int64_t reg_Xn = (Rn == 31) ? 0 : CURRENT_STATE.REGS[Rn];
-                int64_t imm = imm12;
-                int64_t result = reg_Xn + imm;
+// SUBS Immediate (también implementa CMP Immediate cuando Rd=31/XZR)
+static void exec_subs_imm(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    int64_t result = read_reg(s, d->rn) - d->imm;
+    write_reg(s, d->rd, result);
+    set_flags(s, result);
+}
 
-                NEXT_STATE.REGS[Rd] = (Rd == 31) ? 0 : result;
+static void exec_ands(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)  // ANDS (Shifted Register)
+{
+    int64_t result = read_reg(s, d->rn) & read_reg(s, d->rm);
+    write_reg(s, d->rd, result);
+    set_flags(s, result);
+}
 
-                NEXT_STATE.FLAG_Z = (result == 0) ? 1 : 0;
-                NEXT_STATE.FLAG_N = (result < 0) ? 1 : 0;
-                break;
-            }
+static void exec_eor(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)   // EOR (Shifted Register)
+{
+    write_reg(s, d->rd, read_reg(s, d->rn) ^ read_reg(s, d->rm));
+}
 
-            case 0x788: {  // SUBS Immediate (también implementa CMP Immediate cuando Rd=31/XZR)
-                uint32_t Rd = instruction & 0x1F;
-                uint32_t Rn = (instruction >> 5) & 0x1F;
-                uint32_t imm12 = (instruction >> 10) & 0xFFF;
-                uint32_t shift = (instruction >> 22) & 0x3;
-                
-                // Aplicar shift si es necesario (01 = LSL #12)
-                if (shift == 1) {
-                    imm12 <<= 12;
-                }
-                
-                int64_t reg_Xn = (Rn == 31) ? 0 : CURRENT_STATE.REGS[Rn];
-                int64_t result = reg_Xn - imm12;
-                
-                NEXT_STATE.REGS[Rd] = (Rd == 31) ? 0 : result;
-                
-                // Actualizar FLAGS
-                NEXT_STATE.FLAG_Z = (result == 0) ? 1 : 0;
-                NEXT_STATE.FLAG_N = (result < 0) ? 1 : 0;
-                break;
-            }
-            case 0x750: {  // ANDS (Shifted Register)
-                uint32_t Rd = instruction & 0x1F;
-                uint32_t Rn = (instruction >> 5) & 0x1F;
-                uint32_t Rm = (instruction >> 16) & 0x1F;
+static void exec_orr(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)   // ORR (Shifted Register)
+{
+    write_reg(s, d->rd, read_reg(s, d->rn) | read_reg(s, d->rm));
+}
 
-                int64_t reg_Xn = (Rn == 31) ? 0 : CURRENT_STATE.REGS[Rn];
-                int64_t reg_Xm = (Rm == 31) ? 0 : CURRENT_STATE.REGS[Rm];
-                int64_t result = reg_Xn & reg_Xm;
+static void exec_b(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    s->PC = d->target;
+}
 
-                NEXT_STATE.REGS[Rd] = (Rd == 31) ? 0 : result;
+static void exec_br(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    s->PC = s->REGS[d->rn];
+}
 
-                // Actualizar FLAGS
-                NEXT_STATE.FLAG_Z = (result == 0) ? 1 : 0;
-                NEXT_STATE.FLAG_N = (result < 0) ? 1 : 0;
-                break;
-            }
-            case 0x650: {  // EOR (Shifted Register)
-                uint32_t Rd = instruction & 0x1F;
-                uint32_t Rn = (instruction >> 5) & 0x1F;
-                uint32_t Rm = (instruction >> 16) & 0x1F;
+static void exec_bcond(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    int flag_n = s->FLAG_N;
+    int flag_z = s->FLAG_Z;
+    uint64_t new_address = d->target;
 
-                int64_t reg_Xn = (Rn == 31) ? 0 : CURRENT_STATE.REGS[Rn];
-                int64_t reg_Xm = (Rm == 31) ? 0 : CURRENT_STATE.REGS[Rm];
-                int64_t result = reg_Xn ^ reg_Xm;
+    TRACE(TRACE_EXEC, "B.Cond | cond: 0x%X | flag_n: %d | flag_z: %d | imm19: 0x%X | new_address: 0x%016lX\n",
+           d->cond, flag_n, flag_z, (uint32_t) d->imm, new_address);
 
-                NEXT_STATE.REGS[Rd] = (Rd == 31) ? 0 : result;
-                break;
-            }
-            case 0x550: {  // ORR (Shifted Register)
-                uint32_t Rd = instruction & 0x1F;
-                uint32_t Rn = (instruction >> 5) & 0x1F;
-                uint32_t Rm = (instruction >> 16) & 0x1F;
+    int should_branch = 0;
+    switch (d->cond) {
+        case 0x0: // BEQ
+            should_branch = (flag_z == 1);
+            break;
+        case 0x1: // BNE
+            should_branch = (flag_z == 0);
+            break;
+        case 0xC: // BGT
+            should_branch = (flag_z == 0 && flag_n == 0);
+            break;
+        case 0xB: // BLT
+            should_branch = (flag_n == 1);
+            break;
+        case 0xA: // BGE
+            should_branch = (flag_n == 0);
+            break;
+        case 0xD: // BLE
+            should_branch = (flag_z == 1 || flag_n == 1);
+            break;
+        default:
+            TRACE(TRACE_EXEC, "B.Cond: Unknown condition 0x%X\n", d->cond);
+            return;
+    }
 
-                int64_t reg_Xn = (Rn == 31) ? 0 : CURRENT_STATE.REGS[Rn];
-                int64_t reg_Xm = (Rm == 31) ? 0 : CURRENT_STATE.REGS[Rm];
-                int64_t result = reg_Xn | reg_Xm;
+    if (should_branch) {
+        TRACE(TRACE_EXEC, "B.Cond: Jumping to address 0x%016lX\n", new_address);
+        s->PC = new_address;
+    } else {
+        TRACE(TRACE_EXEC, "B.Cond: Not jumping\n");
+    }
+}
 
-                NEXT_STATE.REGS[Rd] = (Rd == 31) ? 0 : result;
-                break;
-            }
-            case 0x0A0: {  // B (Branch)
-                int32_t imm26 = (instruction & 0x03FFFFFF);  
-                
-                // Sign-extend el immediate a 64 bits y multiplicar por 4 (instrucciones de 4 bytes)
-                int64_t offset = ((int64_t)((int32_t)(imm26 << 6)) >> 6) * 4;
+static void exec_movz(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    write_reg(s, d->rd, d->imm);
+}
 
-                NEXT_STATE.PC = CURRENT_STATE.PC + offset;
-                break;
-            }
-            case 0x6B0: {  // BR (Branch Register)
-                uint32_t Rn = (instruction >> 5) & 0x1F;
+static void exec_lsl(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)   // LSL (Immediate), e.g., lsl X4, X3, 4
+{
+    uint64_t src = s->REGS[d->rn];
+    uint64_t result = src << d->imm;
+    write_reg(s, d->rd, result);
+    TRACE(TRACE_EXEC, "LSL: X%u = 0x%" PRIX64 " << %" PRIu64 " -> X%u = 0x%" PRIX64 "\n",
+           d->rn, src, (uint64_t) d->imm, d->rd, result);
+    set_flags(s, s->REGS[d->rd]);
+}
 
-                NEXT_STATE.PC = CURRENT_STATE.REGS[Rn];
-                break;
-            }
-            case 0x694: {  // MOVZ
-                uint32_t Rd = instruction & 0x1F;
-                uint32_t imm16 = (instruction >> 5) & 0xFFFF;  // Extraer immediate de 16 bits
-                uint32_t hw = (instruction >> 21) & 0x3;  // Extraer hw (shift amount)
-                
-                // De acuerdo a la consigna, solo implementamos para hw = 0
-                int64_t result = imm16;
-                
-                // Si hw no es 0,  mostramos una advertencia pero continuamos con hw = 0
-                if (hw != 0) {
-                    printf("MOVZ: Advertencia - hw != 0 no implementado, usando hw = 0\n");
-                }
-                
-                NEXT_STATE.REGS[Rd] = (Rd == 31) ? 0 : result;
+static void exec_lsr(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    uint64_t src = s->REGS[d->rn];
+    uint64_t result = src >> d->imm;
+    write_reg(s, d->rd, result);
+    TRACE(TRACE_EXEC, "LSR: X%u = 0x%" PRIX64 " >> %" PRIu64 " -> X%u = 0x%" PRIX64 "\n",
+           d->rn, src, (uint64_t) d->imm, d->rd, result);
+    set_flags(s, s->REGS[d->rd]);
+}
+
+// Direccion de un load/store: base Xn (o SP si Rn == 31) + simm9
+static inline uint64_t ls_address(const CPU_State *s, const decoded_inst_t *d)
+{
+    return s->REGS[d->rn] + d->imm;
+}
+
+static void exec_stur(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    mem_write_64(ctx, ls_address(s, d), read_reg(s, d->rd));
+}
+
+static void exec_sturb(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    mem_write_8(ctx, ls_address(s, d), read_reg(s, d->rd));
+}
+
+static void exec_sturh(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    mem_write_16(ctx, ls_address(s, d), read_reg(s, d->rd));
+}
+
+static void exec_ldur(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    write_reg(s, d->rd, mem_read_64(ctx, ls_address(s, d)));
+}
+
+// LDURB y LDURH extienden con ceros
+static void exec_ldurb(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    write_reg(s, d->rd, mem_read_8(ctx, ls_address(s, d)));
+}
+
+static void exec_ldurh(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    write_reg(s, d->rd, mem_read_16(ctx, ls_address(s, d)));
+}
+
+/*
+ * Especificacion de las instrucciones soportadas (variantes de 64 bits).
+ * El orden importa: ante dos candidatos gana el primero, por eso LSR
+ * (imms == 63) va antes que LSL.
+ *
+ * "make specialize" regenera la lista en inst_specs.h (specialize.py)
+ * ordenada por frecuencia de ejecucion sobre un conjunto de programas; las
+ * que nunca se ejecutaron quedan al final.
+ */
+static const inst_spec_t INST_SPECS[] = {
+#ifdef SIM_SPECIALIZED
+#include "inst_specs.h"
+#else
+    { 0xFFE0001F, 0xD4400000, OP_HLT,      FMT_NONE, INST_ENDS_BLOCK,               exec_hlt      },  // HLT
+    { 0xFFE00000, 0xAB000000, OP_ADDS,     FMT_R,    0,                             exec_adds     },  // ADDS (shifted register)
+    { 0xFFE00000, 0xEB000000, OP_SUBS,     FMT_R,    0,                             exec_subs     },  // SUBS (shifted register) / CMP
+    { 0xFF800000, 0xB1000000, OP_ADDS_IMM, FMT_I,    0,                             exec_adds_imm },  // ADDS (immediate)
+    { 0xFF800000, 0xF1000000, OP_SUBS_IMM, FMT_I,    0,                             exec_subs_imm },  // SUBS (immediate) / CMP
+    { 0xFFE00000, 0xEA000000, OP_ANDS,     FMT_R,    0,                             exec_ands     },  // ANDS (shifted register)
+    { 0xFFE00000, 0xCA000000, OP_EOR,      FMT_R,    0,                             exec_eor      },  // EOR (shifted register)
+    { 0xFFE00000, 0xAA000000, OP_ORR,      FMT_R,    0,                             exec_orr      },  // ORR (shifted register)
+    { 0xFC000000, 0x14000000, OP_B,        FMT_B,    INST_ENDS_BLOCK | INST_DIRECT, exec_b        },  // B
+    { 0xFFFFFC1F, 0xD61F0000, OP_BR,       FMT_BR,   INST_ENDS_BLOCK,               exec_br       },  // BR
+    { 0xFF000010, 0x54000000, OP_BCOND,    FMT_CB,   INST_ENDS_BLOCK | INST_DIRECT, exec_bcond    },  // B.cond
+    { 0xFF800000, 0xD2800000, OP_MOVZ,     FMT_IW,   0,                             exec_movz     },  // MOVZ
+    { 0xFFC0FC00, 0xD340FC00, OP_LSR,      FMT_LSR,  0,                             exec_lsr      },  // LSR (UBFM con imms == 63)
+    { 0xFFC00000, 0xD3400000, OP_LSL,      FMT_LSL,  0,                             exec_lsl      },  // LSL (UBFM)
+    { 0xFFE00C00, 0xF8000000, OP_STUR,     FMT_D,    INST_STORE,                    exec_stur     },  // STUR
+    { 0xFFE00C00, 0x38000000, OP_STURB,    FMT_D,    INST_STORE,                    exec_sturb    },  // STURB
+    { 0xFFE00C00, 0x78000000, OP_STURH,    FMT_D,    INST_STORE,                    exec_sturh    },  // STURH
+    { 0xFFE00C00, 0xF8400000, OP_LDUR,     FMT_D,    0,                             exec_ldur     },  // LDUR
+    { 0xFFE00C00, 0x38400000, OP_LDURB,    FMT_D,    0,                             exec_ldurb    },  // LDURB
+    { 0xFFE00C00, 0x78400000, OP_LDURH,    FMT_D,    0,                             exec_ldurh    },  // LDURH
+#endif
+};
+
+#define N_INST_SPECS (sizeof(INST_SPECS) / sizeof(INST_SPECS[0]))
+#define OPCODE_MASK  0xFFE00000
+
+// Compartida entre contextos: se arma una sola vez (pthread_once)
+static const inst_spec_t *DECODE_TABLE[1 << 11];
+static pthread_once_t decode_table_once = PTHREAD_ONCE_INIT;
+
+static void build_decode_table(void)
+{
+    uint32_t opcode;
+    int i;
+
+    for (opcode = 0; opcode < (1 << 11); opcode++) {
+        uint32_t bits = opcode << 21;
+        DECODE_TABLE[opcode] = NULL;
+        for (i = 0; i < N_INST_SPECS; i++) {
+            uint32_t mask = INST_SPECS[i].mask & OPCODE_MASK;
+            if ((bits & mask) == (INST_SPECS[i].match & mask)) {
+                DECODE_TABLE[opcode] = &INST_SPECS[i];
                 break;
             }
+        }
+    }
+}
 
-            case 0x69B: {  // LSL (Immediate), e.g., lsl X4, X3, 4
-                    uint32_t Rd = instruction & 0x1F;            
-                    uint32_t Rn = (instruction >> 5) & 0x1F;      
-                    uint32_t immr = (instruction >> 10) & 0x3F;  
-
-                    uint64_t shift = 63 - immr; 
-                    uint64_t src = CURRENT_STATE.REGS[Rn];
-                    uint64_t result = src << shift;
-                    NEXT_STATE.REGS[Rd] = result;
-                    printf("LSL: X%u = 0x%" PRIX64 " << %" PRIu64 " -> X%u = 0x%" PRIX64 "\n", Rn, src, shift, Rd, result);
-
-                    NEXT_STATE.FLAG_Z = (NEXT_STATE.REGS[Rd] == 0) ? 1 : 0;
-                    NEXT_STATE.FLAG_N = (NEXT_STATE.REGS[Rd] < 0) ? 1 : 0;
-
-
-                    break;
-                }
-
-            case 0x69A:// LSR
-                {   
-                        uint32_t Rd = instruction & 0x1F;              
-                        uint32_t Rn = (instruction >> 5) & 0x1F;       
-                        uint32_t immr = (instruction >> 16) & 0x3F;  // imms
-
-                        uint64_t shift = immr; 
-                        uint64_t src = CURRENT_STATE.REGS[Rn];
-                        uint64_t result = src >> shift;
-                        NEXT_STATE.REGS[Rd] = result;
-                        printf("LSR: X%u = 0x%" PRIX64 " >> %" PRIu64 " -> X%u = 0x%" PRIX64 "\n", Rn, src, shift, Rd, result);
-
-                        NEXT_STATE.FLAG_Z = (NEXT_STATE.REGS[Rd] == 0) ? 1 : 0;
-                        NEXT_STATE.FLAG_N = (NEXT_STATE.REGS[Rd] < 0) ? 1 : 0;
-
-
-                        break;
-                }
-            case 0x7c0: // STUR 
-            {
-                uint32_t Rd = instruction & 0x1F;              
-                uint32_t Rn = (instruction >> 5) & 0x1F;  
-                int32_t imm9 = (instruction >> 12) & 0x1FF;     
-
-                if (imm9 & 0x100) { 
-                    imm9 |= 0xFFFFFE00; 
-                } 
-               
-                uint32_t address = CURRENT_STATE.REGS[Rn] + imm9;     
-                mem_write_32(address, CURRENT_STATE.REGS[Rd]); 
-            }
+// Extiende en signo los 'bits' bits bajos de value
+static inline int64_t sign_extend(uint64_t value, int bits)
+{
+    return (int64_t)(value << (64 - bits)) >> (64 - bits);
+}
+
+static void decode_operands(uint64_t pc, uint32_t instruction, inst_format_t format, decoded_inst_t *d)
+{
+    d->rd = instruction & 0x1F;
+    d->rn = (instruction >> 5) & 0x1F;
+    d->rm = (instruction >> 16) & 0x1F;
+    d->cond = 0;
+    d->imm = 0;
+    d->target = 0;
+
+    switch (format) {
+        case FMT_I: {
+            uint32_t imm12 = (instruction >> 10) & 0xFFF;
+            uint32_t shift = (instruction >> 22) & 0x1;  // 1 = LSL #12
+            d->imm = (int64_t) imm12 << (shift ? 12 : 0);
             break;
-            case 0x1c0: // STURB 
-                {
-                    uint32_t Rd = instruction & 0x1F;              
-                    uint32_t Rn = (instruction >> 5) & 0x1F;  
-                    int32_t imm9 = (instruction >> 12) & 0x1FF;
-                    if (imm9 & 0x100){ 
-                        imm9 |= 0xFFFFFE00; 
-                    }
-
-                uint32_t address = CURRENT_STATE.REGS[Rn] + imm9;
-                uint32_t value = mem_read_32(address);
-                value = (value & 0xFFFFFF00) | (CURRENT_STATE.REGS[Rd] & 0xFF);
-                mem_write_32(address, value);
-                }
-                break;
-            case 0x3E1: // STURH 
-                {
-                    uint32_t Rd = instruction & 0x1F;              
-                    uint32_t Rn = (instruction >> 5) & 0x1F;  
-                    int32_t imm9 = (instruction >> 12) & 0x1FF;
-                    if (imm9 & 0x100) { 
-                        imm9 |= 0xFFFFFE00; 
-                    }
-
-                    uint32_t address = CURRENT_STATE.REGS[Rn] + imm9;
-                    uint32_t value = mem_read_32(address);
-                    value = (value & 0xFFFF0000) | (CURRENT_STATE.REGS[Rd] & 0xFFFF);
-                    mem_write_32(address, value);
-                }
-                break;
-            case 0x7c2: // LDUR 
-                {
-                    uint32_t Rd = instruction & 0x1F;              
-                    uint32_t Rn = (instruction >> 5) & 0x1F;  
-                    int32_t imm9 = (instruction >> 12) & 0x1FF;
-                    if (imm9 & 0x100) { 
-                        imm9 |= 0xFFFFFE00; 
-                    }
-
-                    uint32_t address = CURRENT_STATE.REGS[Rn] + imm9;
-                    uint32_t half_value_1 = mem_read_32(address);
-                    uint32_t half_value_2 = mem_read_32(address + 4); 
-                    uint64_t value = ((uint64_t)half_value_2 << 32) | half_value_1;
-                    NEXT_STATE.REGS[Rd] = value;
-                }
-                break;
-            case 0x1c2: // LDURB 
-                {
-                    uint32_t Rd = instruction & 0x1F;              
-                    uint32_t Rn = (instruction >> 5) & 0x1F;  
-                    int32_t imm9 = (instruction >> 12) & 0x1FF;
-                    uint64_t address = CURRENT_STATE.REGS[Rn] + imm9;
-                    uint32_t byte_value = mem_read_32(address);
-                    uint64_t value = (uint64_t)((int32_t)byte_value);
-                    NEXT_STATE.REGS[Rd] = value;
-                }
-                break;
-            case 0x3c2: // LDURH 
-                {
-                    uint32_t Rd = instruction & 0x1F;              
-                    uint32_t Rn = (instruction >> 5) & 0x1F;  
-                    int32_t imm9 = (instruction >> 12) & 0x1FF;
-                    uint64_t address = CURRENT_STATE.REGS[Rn] + imm9;
-                    uint32_t half_value = mem_read_32(address);
-                    uint64_t value = (uint64_t)((int32_t)half_value);
-                    NEXT_STATE.REGS[Rd] = value;
-                }
-                break;
+        }
+        case FMT_D:
+            d->imm = sign_extend((instruction >> 12) & 0x1FF, 9);
+            break;
+        case FMT_B:
+            d->imm = sign_extend(instruction & 0x03FFFFFF, 26) * 4;
+            d->target = pc + d->imm;
+            break;
+        case FMT_CB:
+            d->cond = instruction & 0xF;
+            d->imm = sign_extend((instruction >> 5) & 0x7FFFF, 19) * 4;
+            d->target = pc + d->imm;
+            break;
+        case FMT_IW: {
+            uint32_t imm16 = (instruction >> 5) & 0xFFFF;
+            uint32_t hw = (instruction >> 21) & 0x3;
+            d->imm = (int64_t) imm16 << (hw * 16);
+            break;
+        }
+        case FMT_LSL:
+            d->imm = 63 - ((instruction >> 10) & 0x3F);  // 63 - imms
+            break;
+        case FMT_LSR:
+            d->imm = (instruction >> 16) & 0x3F;         // immr
+            break;
+        default:
+            break;
+    }
+}
 
+// Decodifica la palabra ubicada en pc; devuelve FALSE si no esta soportada
+static int decode(uint64_t pc, uint32_t instruction, decoded_inst_t *d)
+{
+    const inst_spec_t *spec;
+
+    spec = DECODE_TABLE[(instruction >> 21) & 0x7FF];
+    if (spec == NULL)
+        return FALSE;
+
+    // Las entradas de otros opcodes nunca coinciden con la mascara completa,
+    // asi que basta con recorrer desde el primer candidato
+    for (; spec < INST_SPECS + N_INST_SPECS; spec++) {
+        if ((instruction & spec->mask) == spec->match) {
+            d->handler = spec->handler;
+            d->instruction = instruction;
+            d->op = spec->op;
+            d->flags = spec->flags;
+            decode_operands(pc, instruction, spec->format, d);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
 
+static void exec_unknown(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d)
+{
+    fprintf(ctx->out, "Instrucción desconocida: %x\n", (d->instruction >> 21) & 0x7FF);
+}
 
+/*
+ * Cache de instrucciones pre-decodificadas
+ *
+ * Una entrada por palabra del segmento de texto; handler == NULL indica
+ * que la entrada no es valida. mem_write_32 invalida las palabras que
+ * pisa en el texto a traves de decode_cache_invalidate(). Vive en
+ * ctx->engines (sim.h), una por contexto.
+ */
 
+static inline int in_text(uint64_t address)
+{
+    return address >= MEM_TEXT_START && address < MEM_TEXT_START + MEM_TEXT_SIZE;
+}
 
+static void decode_entry(sim_context_t *ctx, uint64_t pc, decoded_inst_t *d)
+{
+    uint32_t instruction = mem_read_32(ctx, pc);
 
+    if (!decode(pc, instruction, d)) {
+        d->handler = exec_unknown;
+        d->instruction = instruction;
+        d->op = OP_UNKNOWN;
+        d->flags = 0;
+    }
+}
 
-            default:
-                printf("Instrucción desconocida: %x\n", opcode);
-                break;
+static const decoded_inst_t *fetch_decoded(sim_context_t *ctx, uint64_t pc)
+{
+    struct sim_engines *e = ctx->engines;
+    decoded_inst_t *d;
+
+    // Fuera del texto (o desalineado) se decodifica siempre
+    if (!in_text(pc) || (pc & 0x3)) {
+        decode_entry(ctx, pc, &e->uncached);
+        return &e->uncached;
+    }
+
+    d = &e->decode_cache[(pc - MEM_TEXT_START) >> 2];
+    if (d->handler == NULL)
+        decode_entry(ctx, pc, d);
+    return d;
+}
+
+/*
+ * Bloques basicos
+ *
+ * Un bloque es una secuencia de instrucciones pre-decodificadas que termina
+ * en B, BR, B.cond o HLT (o al llegar a MAX_BLOCK_LEN). Se ejecuta entero
+ * sobre CURRENT_STATE sin la copia CURRENT_STATE = NEXT_STATE de cycle().
+ * Cada bloque guarda punteros a sus sucesores (salto tomado y caida), de
+ * modo que solo se vuelve al dispatcher en saltos indirectos (BR).
+ *
+ * Cualquier escritura sobre el texto descarta todos los bloques; el flush
+ * se hace entre bloques para no liberar uno que se esta ejecutando.
+ *
+ * Las instrucciones decodificadas de cada bloque salen de la cache
+ * compartida (codecache.c), indexada por el hash del texto y el PC; los
+ * enlaces, el contador y el codigo del JIT son de cada contexto. Si el
+ * programa pisa su texto deja de compartir y decodifica en bloques propios.
+ */
+#define MAX_BLOCK_LEN 64
+#define JIT_THRESHOLD 16     // ejecuciones antes de compilar un bloque
+
+/*
+ * Interprete threaded: una direccion de etiqueta por palabra del texto
+ * (engines->threaded.labels), en paralelo a la cache de decodificacion.
+ * Las palabras sin traducir (o invalidadas) apuntan a la etiqueta que las
+ * traduce.
+ */
+
+static void invalidate_word(struct sim_engines *e, uint64_t address)
+{
+    uint64_t idx = (address - MEM_TEXT_START) >> 2;
+
+    e->decode_cache[idx].handler = NULL;
+    if (e->threaded.translate != NULL)
+        e->threaded.labels[idx] = e->threaded.translate;
+    e->block_flush_pending = TRUE;
+    // El texto ya no es el del hash: de aca en mas los bloques son propios
+    if (e->shared.text_hash != 0) {
+        e->shared.text_hash = 0;
+        e->shared.private_text = TRUE;
+    }
+}
+
+void decode_cache_invalidate(sim_context_t *ctx, uint64_t address)
+{
+    uint64_t first = address & ~0x3ULL;
+    uint64_t last = (address + 3) & ~0x3ULL;  // escrituras desalineadas tocan dos palabras
+
+    if (in_text(first))
+        invalidate_word(ctx->engines, first);
+    if (last != first && in_text(last))
+        invalidate_word(ctx->engines, last);
+}
+
+static void flush_blocks(struct sim_engines *e)
+{
+    block_t *b, *next;
+
+    for (b = e->blocks.all; b != NULL; b = next) {
+        next = b->next_alloc;
+        free(b);
+    }
+    e->blocks.all = NULL;
+    memset(e->blocks.map, 0, sizeof(e->blocks.map));
+    jit_flush(&e->jit);
+    e->block_flush_pending = FALSE;
+}
+
+struct sim_engines *engines_create(void)
+{
+    pthread_once(&decode_table_once, build_decode_table);
+    return calloc(1, sizeof(struct sim_engines));
+}
+
+void engines_destroy(struct sim_engines *e)
+{
+    flush_blocks(e);
+    jit_release(&e->jit);
+    free(e);
+}
+
+// Para un programa nuevo: se vuelve a hashear el texto al traducir
+void engines_reset(struct sim_engines *e)
+{
+    e->shared.text_hash = 0;
+    e->shared.private_text = FALSE;
+}
+
+// Ejecuta una sola instruccion in situ sobre s
+static void step(sim_context_t *ctx, CPU_State *s)
+{
+    const decoded_inst_t *d = fetch_decoded(ctx, s->PC);
+
+    s->PC += 4;
+    d->handler(ctx, s, d);
+}
+
+// Largo del bloque que empieza en start
+static int block_length(sim_context_t *ctx, uint64_t start)
+{
+    const decoded_inst_t *d;
+    int len = 0;
+
+    do {
+        d = fetch_decoded(ctx, start + 4 * len);
+        len++;
+    } while (!(d->flags & INST_ENDS_BLOCK) && len < MAX_BLOCK_LEN &&
+             in_text(start + 4 * len));
+    return len;
+}
+
+/*
+ * Busca el bloque en la cache compartida y si no esta lo decodifica y lo
+ * publica. Solo mientras el texto sea el que se cargo (el del hash).
+ */
+static const shared_block_t *shared_block(sim_context_t *ctx, uint64_t start)
+{
+    struct sim_engines *e = ctx->engines;
+    const shared_block_t *sb;
+    shared_block_t *b;
+    int i, len;
+
+    if (e->shared.text_hash == 0)
+        e->shared.text_hash = mem_hash(ctx, MEM_TEXT_START, MEM_TEXT_SIZE) | 1;
+
+    sb = code_cache_lookup(ctx, e->shared.text_hash, start);
+    if (sb != NULL)
+        return sb;
+
+    len = block_length(ctx, start);
+    b = malloc(sizeof(shared_block_t) + len * sizeof(decoded_inst_t));
+    assert(b != NULL);
+    b->text_hash = e->shared.text_hash;
+    b->start = start;
+    b->len = len;
+    for (i = 0; i < len; i++)
+        b->ops[i] = *fetch_decoded(ctx, start + 4 * i);
+    return code_cache_insert(b);
+}
+
+static block_t *translate_block(sim_context_t *ctx, uint64_t start)
+{
+    struct sim_engines *e = ctx->engines;
+    const shared_block_t *sb = NULL;
+    block_t *b;
+    int len;
+
+    if (!e->shared.private_text) {
+        sb = shared_block(ctx, start);
+        b = malloc(sizeof(block_t));
+        assert(b != NULL);
+        b->len = sb->len;
+        b->ops = sb->ops;
+    } else {
+        len = block_length(ctx, start);
+        b = malloc(sizeof(block_t) + len * sizeof(decoded_inst_t));
+        assert(b != NULL);
+        b->len = len;
+        for (len = 0; len < b->len; len++)
+            b->own[len] = *fetch_decoded(ctx, start + 4 * len);
+        b->ops = b->own;
+    }
+    b->start = start;
+    b->taken = NULL;
+    b->fallthrough = NULL;
+    b->exec_count = 0;
+    b->native = NULL;
+
+    b->next_alloc = e->blocks.all;
+    e->blocks.all = b;
+    return b;
+}
+
+// Devuelve el bloque que empieza en pc, o NULL si pc esta fuera del texto
+static block_t *lookup_block(sim_context_t *ctx, uint64_t pc)
+{
+    struct sim_engines *e = ctx->engines;
+    block_t **slot;
+
+    if (e->block_flush_pending)
+        flush_blocks(e);
+    if (!in_text(pc) || (pc & 0x3))
+        return NULL;
+
+    slot = &e->blocks.map[(pc - MEM_TEXT_START) >> 2];
+    if (*slot == NULL)
+        *slot = translate_block(ctx, pc);
+    return *slot;
+}
+
+// Ejecuta hasta max instrucciones del bloque; devuelve cuantas ejecuto
+static int run_block(sim_context_t *ctx, CPU_State *s, block_t *b, int max)
+{
+    int n = (b->len < max) ? b->len : max;
+    int i;
+
+    // Con el motor jit los bloques calientes se compilan; el codigo nativo
+    // ejecuta el bloque entero, asi que solo se usa si entra en el presupuesto
+    if (ctx->ENGINE == ENGINE_JIT && b->len <= max) {
+        if (b->native == NULL && ++b->exec_count == JIT_THRESHOLD)
+            b->native = jit_compile(ctx, b);
+        if (b->native != NULL)
+            return b->native(s);
+    }
+
+    for (i = 0; i < n; i++) {
+        const decoded_inst_t *d = &b->ops[i];
+        s->PC += 4;
+        d->handler(ctx, s, d);
+        // Un store sobre el texto invalida este mismo bloque
+        if ((d->flags & INST_STORE) && ctx->engines->block_flush_pending)
+            return i + 1;
+    }
+    return n;
+}
+
+// Enlace a seguir desde b hacia pc; NULL si el destino es indirecto
+static block_t **successor_slot(block_t *b, uint64_t pc)
+{
+    const decoded_inst_t *last = &b->ops[b->len - 1];
+
+    if (pc == b->start + 4 * b->len)
+        return &b->fallthrough;
+    if ((last->flags & INST_DIRECT) && pc == last->target)
+        return &b->taken;
+    return NULL;
+}
+
+static int execute_blocks(sim_context_t *ctx, int max_insts)
+{
+    CPU_State *s = &ctx->CURRENT_STATE;
+    block_t *b = NULL;
+    block_t **link = NULL;
+    int executed = 0;
+    unsigned generation;
+
+    // Los bloques apuntan a la cache compartida: si se vacio, se descartan.
+    // Lo que se traduzca desde aca queda asociado a esta generacion
+    code_cache_enter();
+    generation = code_cache_generation();
+    if (ctx->engines->shared.generation != generation)
+        flush_blocks(ctx->engines);
+    ctx->engines->shared.generation = generation;
+
+    while (ctx->RUN_BIT && executed < max_insts) {
+        if (b == NULL) {
+            b = lookup_block(ctx, s->PC);
+            if (link != NULL)
+                *link = b;  // encadenar para no volver a pasar por aca
         }
+
+        if (b == NULL) {
+            // Fuera del texto: de a una instruccion
+            step(ctx, s);
+            executed++;
+            link = NULL;
+            continue;
+        }
+
+        executed += run_block(ctx, s, b, max_insts - executed);
+        if (ctx->engines->block_flush_pending) {
+            b = NULL;
+            link = NULL;
+            continue;
+        }
+        link = successor_slot(b, s->PC);
+        b = (link != NULL) ? *link : NULL;
+    }
+    code_cache_leave();
+
+    ctx->NEXT_STATE = ctx->CURRENT_STATE;
+    return executed;
+}
+
+#if defined(__GNUC__)
+
+/*
+ * Cada etiqueta ejecuta su instruccion (los handlers son static y el
+ * compilador los puede expandir en linea) y salta directamente a la
+ * etiqueta de la siguiente con goto *, sin volver a un switch ni pasar por
+ * go() -> cycle() -> process_instruction().
+ */
+#define THREADED_OP(op, handler)                \
+    op:                                         \
+        s->PC += 4;                             \
+        handler(ctx, s, d);                     \
+        DISPATCH()
+
+#define DISPATCH()                                                      \
+    do {                                                                \
+        idx = (s->PC - MEM_TEXT_START) >> 2;                            \
+        if (++executed >= max_insts || idx >= TEXT_WORDS || (s->PC & 0x3)) \
+            goto leave;                                                 \
+        d = &e->decode_cache[idx];                                      \
+        goto *e->threaded.labels[idx];                                  \
+    } while (0)
+
+static int execute_threaded(sim_context_t *ctx, int max_insts)
+{
+    static void *const op_labels[] = {
+        [OP_UNKNOWN] = &&op_unknown, [OP_HLT] = &&op_hlt,
+        [OP_ADDS] = &&op_adds, [OP_SUBS] = &&op_subs,
+        [OP_ADDS_IMM] = &&op_adds_imm, [OP_SUBS_IMM] = &&op_subs_imm,
+        [OP_ANDS] = &&op_ands, [OP_EOR] = &&op_eor, [OP_ORR] = &&op_orr,
+        [OP_B] = &&op_b, [OP_BR] = &&op_br, [OP_BCOND] = &&op_bcond,
+        [OP_MOVZ] = &&op_movz, [OP_LSL] = &&op_lsl, [OP_LSR] = &&op_lsr,
+        [OP_STUR] = &&op_stur, [OP_STURB] = &&op_sturb, [OP_STURH] = &&op_sturh,
+        [OP_LDUR] = &&op_ldur, [OP_LDURB] = &&op_ldurb, [OP_LDURH] = &&op_ldurh,
+    };
+    struct sim_engines *e = ctx->engines;
+    CPU_State *s = &ctx->CURRENT_STATE;
+    const decoded_inst_t *d;
+    uint64_t idx;
+    int executed = 0;
+
+    if (e->threaded.translate == NULL) {
+        for (idx = 0; idx < TEXT_WORDS; idx++)
+            e->threaded.labels[idx] = &&translate;
+        e->threaded.translate = &&translate;
     }
 
-    // Actualiza el PC para instrucciones que no sean saltos explícitos
-    if (opcode != 0x0A0 && opcode != 0x6B0 && opcode_high != 0x54) {
-        NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+    while (ctx->RUN_BIT && executed < max_insts) {
+        if (!in_text(s->PC) || (s->PC & 0x3)) {
+            step(ctx, s);
+            executed++;
+            continue;
+        }
+        idx = (s->PC - MEM_TEXT_START) >> 2;
+        d = &e->decode_cache[idx];
+        goto *e->threaded.labels[idx];
+
+    translate:
+        d = fetch_decoded(ctx, s->PC);
+        e->threaded.labels[idx] = op_labels[d->op];
+        goto *e->threaded.labels[idx];
+
+        THREADED_OP(op_unknown, exec_unknown);
+        THREADED_OP(op_adds, exec_adds);
+        THREADED_OP(op_subs, exec_subs);
+        THREADED_OP(op_adds_imm, exec_adds_imm);
+        THREADED_OP(op_subs_imm, exec_subs_imm);
+        THREADED_OP(op_ands, exec_ands);
+        THREADED_OP(op_eor, exec_eor);
+        THREADED_OP(op_orr, exec_orr);
+        THREADED_OP(op_b, exec_b);
+        THREADED_OP(op_br, exec_br);
+        THREADED_OP(op_bcond, exec_bcond);
+        THREADED_OP(op_movz, exec_movz);
+        THREADED_OP(op_lsl, exec_lsl);
+        THREADED_OP(op_lsr, exec_lsr);
+        THREADED_OP(op_stur, exec_stur);
+        THREADED_OP(op_sturb, exec_sturb);
+        THREADED_OP(op_sturh, exec_sturh);
+        THREADED_OP(op_ldur, exec_ldur);
+        THREADED_OP(op_ldurb, exec_ldurb);
+        THREADED_OP(op_ldurh, exec_ldurh);
+
+    op_hlt:
+        s->PC += 4;
+        exec_hlt(ctx, s, d);
+        executed++;
+
+    leave:
+        ;
+    }
+
+    ctx->NEXT_STATE = ctx->CURRENT_STATE;
+    return executed;
+}
+
+#else
+
+// Sin etiquetas como valores (extension de GCC) se usa el motor de bloques
+#define execute_threaded execute_blocks
+
+#endif
+
+int process_instructions(sim_context_t *ctx, int max_insts)
+{
+    switch (ctx->ENGINE) {
+        case ENGINE_BLOCK:
+        case ENGINE_JIT:
+            return execute_blocks(ctx, max_insts);
+        case ENGINE_THREADED:
+            return execute_threaded(ctx, max_insts);
+        default:
+            assert(0);
+            return 0;
+    }
+}
+
+#ifdef SIM_PROFILE
+#include <stdatomic.h>
+
+/*
+ * Conteo de instrucciones ejecutadas por operacion, para specialize.py. Al
+ * salir se agrega una linea "OP_xxx cuenta" por operacion al archivo
+ * $SIM_OPCOUNTS (opcounts.txt si no esta definida).
+ */
+static const char *OP_NAMES[N_INST_OPS] = {
+    [OP_UNKNOWN] = "OP_UNKNOWN", [OP_HLT] = "OP_HLT",
+    [OP_ADDS] = "OP_ADDS", [OP_SUBS] = "OP_SUBS",
+    [OP_ADDS_IMM] = "OP_ADDS_IMM", [OP_SUBS_IMM] = "OP_SUBS_IMM",
+    [OP_ANDS] = "OP_ANDS", [OP_EOR] = "OP_EOR", [OP_ORR] = "OP_ORR",
+    [OP_B] = "OP_B", [OP_BR] = "OP_BR", [OP_BCOND] = "OP_BCOND",
+    [OP_MOVZ] = "OP_MOVZ", [OP_LSL] = "OP_LSL", [OP_LSR] = "OP_LSR",
+    [OP_STUR] = "OP_STUR", [OP_STURB] = "OP_STURB", [OP_STURH] = "OP_STURH",
+    [OP_LDUR] = "OP_LDUR", [OP_LDURB] = "OP_LDURB", [OP_LDURH] = "OP_LDURH",
+};
+
+/* Los hilos de --jobs cuentan sobre los mismos contadores */
+static atomic_uint_fast64_t OP_COUNTS[N_INST_OPS];
+static pthread_once_t op_counts_once = PTHREAD_ONCE_INIT;
+
+static void dump_op_counts(void)
+{
+    const char *path = getenv("SIM_OPCOUNTS");
+    FILE *f = fopen(path ? path : "opcounts.txt", "a");
+    int op;
+
+    if (f == NULL)
+        return;
+    for (op = 0; op < N_INST_OPS; op++)
+        fprintf(f, "%s %" PRIu64 "\n", OP_NAMES[op], (uint64_t) atomic_load(&OP_COUNTS[op]));
+    fclose(f);
+}
+
+static void register_op_counts(void)
+{
+    atexit(dump_op_counts);
+}
+
+static void count_op(const decoded_inst_t *d)
+{
+    pthread_once(&op_counts_once, register_op_counts);
+    atomic_fetch_add_explicit(&OP_COUNTS[d->op], 1, memory_order_relaxed);
+}
+#endif
+
+/*
+ * Registro binario de una instruccion ya ejecutada sobre NEXT_STATE. La
+ * direccion de los loads/stores se calcula antes de ejecutar porque un
+ * load puede pisar su propio registro base.
+ */
+static void record_instruction(sim_context_t *ctx, uint64_t pc, const decoded_inst_t *d, uint64_t addr)
+{
+    const CPU_State *s = &ctx->NEXT_STATE;
+    trace_record_t r;
+
+    memset(&r, 0, sizeof(r));
+    r.pc = pc;
+    r.instruction = d->instruction;
+    r.rd = TRACE_NO_REG;
+    r.flags = (s->FLAG_N ? TRACE_FLAG_N : 0) | (s->FLAG_Z ? TRACE_FLAG_Z : 0);
+
+    switch (d->op) {
+        case OP_STUR:
+        case OP_STURB:
+        case OP_STURH:
+        case OP_LDUR:
+        case OP_LDURB:
+        case OP_LDURH:
+            r.mem = (d->flags & INST_STORE) ? TRACE_MEM_STORE : TRACE_MEM_LOAD;
+            r.mem_addr = addr;
+            if (d->op == OP_STURB || d->op == OP_LDURB) {
+                r.mem_size = 1;
+                r.mem_value = mem_read_8(ctx, addr);
+            } else if (d->op == OP_STURH || d->op == OP_LDURH) {
+                r.mem_size = 2;
+                r.mem_value = mem_read_16(ctx, addr);
+            } else {
+                r.mem_size = 8;
+                r.mem_value = mem_read_64(ctx, addr);
+            }
+            if (r.mem == TRACE_MEM_STORE)
+                break;
+            // fallthrough: los loads tambien escriben Rt
+        case OP_ADDS:
+        case OP_SUBS:
+        case OP_ADDS_IMM:
+        case OP_SUBS_IMM:
+        case OP_ANDS:
+        case OP_EOR:
+        case OP_ORR:
+        case OP_MOVZ:
+        case OP_LSL:
+        case OP_LSR:
+            r.rd = d->rd;
+            r.value = read_reg(s, d->rd);
+            break;
+        default:
+            break;
+    }
+
+    trace_write(&r);
+}
+
+void process_instruction(sim_context_t *ctx)
+{
+    const decoded_inst_t *d = fetch_decoded(ctx, ctx->CURRENT_STATE.PC);
+    CPU_State *next = &ctx->NEXT_STATE;
+    uint64_t addr;
+
+    if (TRACE_ON(TRACE_INST))
+        trace_instruction(ctx->CURRENT_STATE.PC, d->instruction);
+#ifdef SIM_PROFILE
+    count_op(d);
+#endif
+
+    // NEXT_STATE llega igual a CURRENT_STATE (cycle() los iguala), asi que
+    // el handler puede ejecutar in situ sobre NEXT_STATE
+    next->PC = ctx->CURRENT_STATE.PC + 4;
+    if (TRACE_RECORD_ON()) {
+        addr = ls_address(next, d);
+        d->handler(ctx, next, d);
+        record_instruction(ctx, ctx->CURRENT_STATE.PC, d, addr);
+        return;
     }
+    d->handler(ctx, next, d);
 }
@@ -0,0 +1,144 @@
+/*
+ * Tipos internos del simulador compartidos entre sim.c y los motores de
+ * ejecucion (jit.c).
+ */
+
+#ifndef _SIM_SIM_H_
+#define _SIM_SIM_H_
+
+#include "shell.h"
+
+typedef enum {
+    OP_UNKNOWN,
+    OP_HLT,
+    OP_ADDS,
+    OP_SUBS,
+    OP_ADDS_IMM,
+    OP_SUBS_IMM,
+    OP_ANDS,
+    OP_EOR,
+    OP_ORR,
+    OP_B,
+    OP_BR,
+    OP_BCOND,
+    OP_MOVZ,
+    OP_LSL,
+    OP_LSR,
+    OP_STUR,
+    OP_STURB,
+    OP_STURH,
+    OP_LDUR,
+    OP_LDURB,
+    OP_LDURH,
+    N_INST_OPS
+} inst_op_t;
+
+typedef struct decoded_inst decoded_inst_t;
+typedef void (*inst_handler_t)(sim_context_t *ctx, CPU_State *s, const decoded_inst_t *d);
+
+/*
+ * Los handlers trabajan in situ sobre el estado que reciben: leen todos sus
+ * operandos antes de escribir el destino. El PC ya llega apuntando a la
+ * instruccion siguiente y solo los saltos lo modifican.
+ */
+struct decoded_inst {
+    inst_handler_t handler;
+    uint32_t instruction;
+    uint8_t op;             // inst_op_t
+    uint8_t rd;             // Rd, o Rt en loads/stores
+    uint8_t rn;
+    uint8_t rm;
+    uint8_t cond;           // condicion de B.cond
+    uint8_t flags;          // INST_*
+    int64_t imm;            // inmediato ya extendido en signo y desplazado
+    uint64_t target;        // destino absoluto de B y B.cond
+};
+
+#define INST_ENDS_BLOCK 0x1     // B, BR, B.cond y HLT cierran un bloque basico
+#define INST_DIRECT     0x2     // salto con destino conocido al decodificar
+#define INST_STORE      0x4     // escribe memoria (puede pisar el texto)
+
+/* Codigo nativo de un bloque: devuelve cuantas instrucciones ejecuto */
+typedef int (*native_block_t)(CPU_State *s);
+
+/* Bloque decodificado publicado en la cache compartida (codecache.c) */
+typedef struct shared_block shared_block_t;
+struct shared_block {
+    uint64_t text_hash;     // programa del que sale
+    uint64_t start;
+    int len;
+    shared_block_t *next;   // cadena del bucket, o lista de retirados
+    decoded_inst_t ops[];
+};
+
+typedef struct block block_t;
+struct block {
+    uint64_t start;
+    int len;
+    const decoded_inst_t *ops;  // de un shared_block_t, o own
+    block_t *taken;         // sucesor si se toma el salto directo final
+    block_t *fallthrough;   // sucesor en start + 4 * len
+    block_t *next_alloc;    // lista de todos los bloques, para el flush
+    uint32_t exec_count;    // ejecuciones interpretadas (motor jit)
+    native_block_t native;  // codigo compilado, o NULL
+    decoded_inst_t own[];   // copia privada si el texto no se comparte
+};
+
+#define TEXT_WORDS (MEM_TEXT_SIZE / 4)
+
+/* Arena RWX del JIT (jit.c) */
+typedef struct {
+    uint8_t *base;
+    size_t used;
+    int failed;     // mmap fallo: no se compila nada
+} jit_arena_t;
+
+/*
+ * Estado de los motores de un sim_context. Todo lo que depende del texto
+ * del programa vive aca, asi cada contexto decodifica y compila lo suyo.
+ */
+struct sim_engines {
+    decoded_inst_t decode_cache[TEXT_WORDS];    // handler == NULL: invalida
+    decoded_inst_t uncached;                    // palabra fuera del texto
+    struct {
+        block_t *map[TEXT_WORDS];   // bloque que empieza en cada palabra
+        block_t *all;
+    } blocks;
+    /* Se activa cuando un store pisa el texto; los bloques se descartan */
+    int block_flush_pending;
+    struct {
+        uint64_t text_hash;         // 0: sin calcular todavia
+        int private_text;           // el programa piso su texto ya hasheado
+        unsigned generation;        // de la cache compartida al armar blocks
+    } shared;
+    struct {
+        void *labels[TEXT_WORDS];
+        void *translate;            // NULL hasta la primera ejecucion
+    } threaded;
+    jit_arena_t jit;
+};
+
+/*
+ * Cache compartida de bloques decodificados (codecache.c). Los punteros
+ * que devuelve lookup/insert valen mientras el hilo este entre enter y
+ * leave, o hasta que cambie la generacion.
+ */
+void code_cache_enter(void);
+void code_cache_leave(void);
+unsigned code_cache_generation(void);
+/* Solo devuelve un bloque cuyas palabras coinciden con la memoria de ctx */
+const shared_block_t *code_cache_lookup(sim_context_t *ctx, uint64_t text_hash, uint64_t start);
+/* Publica b (de malloc); si otro hilo se adelanto con las mismas palabras
+   libera b y devuelve el suyo */
+const shared_block_t *code_cache_insert(shared_block_t *b);
+
+/* Compila un bloque a x86-64; devuelve NULL si no es posible */
+native_block_t jit_compile(sim_context_t *ctx, const block_t *b);
+
+/* Descarta todo el codigo generado */
+void jit_flush(jit_arena_t *jit);
+
+/* Libera la arena */
+void jit_release(jit_arena_t *jit);
+
+#endif
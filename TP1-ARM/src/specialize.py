@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+#
+# Genera inst_specs.h: las filas de INST_SPECS de sim.c ordenadas por
+# frecuencia de ejecucion (la mas usada primero), a partir de los conteos
+# que deja un build con -DSIM_PROFILE.
+#
+#   specialize.py sim.c opcounts.txt > inst_specs.h
+#
+# No se descarta ninguna fila: las que nunca se ejecutaron quedan al
+# final en su orden original, asi el binario sigue decodificando todo.
+# Si dos codificaciones se solapan (LSR es un caso particular de LSL) se
+# respeta su orden original, porque el decodificador se queda con la
+# primera que coincide.
+
+import argparse
+import re
+import sys
+
+ROW = re.compile(r'^\s*\{\s*(0x[0-9A-Fa-f]+),\s*(0x[0-9A-Fa-f]+),\s*(OP_\w+),')
+
+def read_rows(sim_c):
+    rows = []
+    for line in open(sim_c):
+        m = ROW.match(line)
+        if m:
+            rows.append((int(m.group(1), 16), int(m.group(2), 16), m.group(3), line.rstrip()))
+    return rows
+
+def read_counts(paths):
+    counts = {}
+    for path in paths:
+        for line in open(path):
+            fields = line.split()
+            if len(fields) == 2:
+                counts[fields[0]] = counts.get(fields[0], 0) + int(fields[1])
+    return counts
+
+def overlap(a, b):
+    # Alguna palabra coincide con las dos mascaras
+    common = a[0] & b[0]
+    return (a[1] & common) == (b[1] & common)
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("sim_c")
+    parser.add_argument("counts", nargs="+")
+    args = parser.parse_args()
+
+    rows = read_rows(args.sim_c)
+    counts = read_counts(args.counts)
+    if not rows:
+        sys.exit("specialize.py: no INST_SPECS rows in %s" % args.sim_c)
+
+    order = sorted(range(len(rows)), key=lambda i: -counts.get(rows[i][2], 0))
+
+    # Reordenamiento estable: una fila no puede adelantarse a otra anterior
+    # con la que se solapa
+    result = []
+    for i in order:
+        pos = len(result)
+        for j, k in enumerate(result):
+            if k > i and overlap(rows[i], rows[k]):
+                pos = min(pos, j)
+        result.insert(pos, i)
+
+    print("// Generado por specialize.py a partir de %s; no editar" % " ".join(args.counts))
+    for i in result:
+        print("%s  // %d" % (rows[i][3].split("  //")[0], counts.get(rows[i][2], 0)))
+
+main()
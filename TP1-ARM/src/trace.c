@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "trace.h"
+#include "lz.h"
+
+int TRACE_LEVEL = TRACE_OFF;
+int TRACE_RECORDING = FALSE;
+
+void trace_instruction(uint64_t pc, uint32_t instruction)
+{
+    uint32_t opcode = (instruction >> 21) & 0x7FF;
+    uint32_t opcode_high = (instruction >> 24) & 0xFF;  // Los 8 bits más altos
+
+    printf("PC: 0x%016lX | Instruction: 0x%08X | Opcode: 0x%X\n",
+       (unsigned long) pc, instruction, opcode);
+    printf("Instrucción: 0x%08X, opcode_high: 0x%X, primeros 8 bits: 0x%X\n",
+       instruction, opcode_high, instruction >> 24);
+}
+
+void trace_effect(const trace_record_t *r)
+{
+    printf("  N: %d Z: %d", !!(r->flags & TRACE_FLAG_N), !!(r->flags & TRACE_FLAG_Z));
+    if (r->rd != TRACE_NO_REG)
+        printf(" | X%u = 0x%" PRIX64, r->rd, r->value);
+    if (r->mem)
+        printf(" | %s%u [0x%" PRIX64 "] = 0x%" PRIX64,
+               r->mem == TRACE_MEM_LOAD ? "load" : "store", r->mem_size * 8,
+               r->mem_addr, r->mem_value);
+    printf("\n");
+}
+
+/*
+ * Buffer circular de TRACE_RING_BLOCKS bloques. El simulador llena el
+ * bloque head % TRACE_RING_BLOCKS sin lock y solo lo toma para publicarlo;
+ * el escritor consume desde tail. Si el escritor se atrasa una vuelta
+ * entera, el simulador espera.
+ */
+#define TRACE_BLOCK_RECORDS 4096
+#define TRACE_RING_BLOCKS   64      // 64 * 4096 * 40 bytes = 10 MiB
+
+static struct {
+    FILE *file;
+    int compress;
+    trace_record_t *ring;
+    int counts[TRACE_RING_BLOCKS];  // registros de cada bloque publicado
+    int fill;                       // registros en el bloque que se llena
+    uint64_t head, tail;            // bloques publicados / ya escritos
+    int stop;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, space;
+} SINK = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+};
+
+static void write_block(const trace_record_t *records, int count, uint8_t *buffer)
+{
+    uint32_t sizes[2];
+    const void *data = records;
+
+    sizes[0] = sizes[1] = count * sizeof(trace_record_t);
+    if (SINK.compress) {
+        size_t packed = lz_compress((const uint8_t *) records, sizes[0], buffer);
+
+        if (packed < sizes[0]) {
+            sizes[1] = packed;
+            data = buffer;
+        }
+    }
+    fwrite(sizes, sizeof(sizes), 1, SINK.file);
+    fwrite(data, sizes[1], 1, SINK.file);
+}
+
+static void *writer_main(void *arg)
+{
+    uint8_t *buffer = malloc(LZ_BOUND(TRACE_BLOCK_RECORDS * sizeof(trace_record_t)));
+    int blk;
+
+    pthread_mutex_lock(&SINK.lock);
+    for (;;) {
+        while (SINK.tail == SINK.head && !SINK.stop)
+            pthread_cond_wait(&SINK.ready, &SINK.lock);
+        if (SINK.tail == SINK.head)
+            break;
+        blk = SINK.tail % TRACE_RING_BLOCKS;
+        pthread_mutex_unlock(&SINK.lock);
+
+        write_block(SINK.ring + blk * TRACE_BLOCK_RECORDS, SINK.counts[blk], buffer);
+
+        pthread_mutex_lock(&SINK.lock);
+        SINK.tail++;
+        pthread_cond_signal(&SINK.space);
+    }
+    pthread_mutex_unlock(&SINK.lock);
+
+    free(buffer);
+    return NULL;
+}
+
+static void publish(void)
+{
+    pthread_mutex_lock(&SINK.lock);
+    SINK.counts[SINK.head % TRACE_RING_BLOCKS] = SINK.fill;
+    SINK.head++;
+    pthread_cond_signal(&SINK.ready);
+    while (SINK.head - SINK.tail == TRACE_RING_BLOCKS)
+        pthread_cond_wait(&SINK.space, &SINK.lock);
+    pthread_mutex_unlock(&SINK.lock);
+    SINK.fill = 0;
+}
+
+void trace_write(const trace_record_t *r)
+{
+    int blk = SINK.head % TRACE_RING_BLOCKS;
+
+    SINK.ring[blk * TRACE_BLOCK_RECORDS + SINK.fill++] = *r;
+    if (SINK.fill == TRACE_BLOCK_RECORDS)
+        publish();
+}
+
+int trace_open(const char *filename, int compress)
+{
+    static int registered;
+    trace_file_header_t header = { TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record_t) };
+
+    trace_close();
+
+    SINK.ring = malloc(sizeof(trace_record_t) * TRACE_BLOCK_RECORDS * TRACE_RING_BLOCKS);
+    SINK.file = fopen(filename, "wb");
+    if (SINK.ring == NULL || SINK.file == NULL) {
+        free(SINK.ring);
+        if (SINK.file)
+            fclose(SINK.file);
+        SINK.ring = NULL;
+        SINK.file = NULL;
+        return FALSE;
+    }
+    fwrite(&header, sizeof(header), 1, SINK.file);
+
+    SINK.compress = compress;
+    SINK.fill = 0;
+    SINK.head = SINK.tail = 0;
+    SINK.stop = FALSE;
+    if (pthread_create(&SINK.writer, NULL, writer_main, NULL) != 0) {
+        fclose(SINK.file);
+        free(SINK.ring);
+        SINK.file = NULL;
+        SINK.ring = NULL;
+        return FALSE;
+    }
+
+    // quit sale con exit(): que no se pierda el ultimo bloque
+    if (!registered) {
+        atexit(trace_close);
+        registered = TRUE;
+    }
+    TRACE_RECORDING = TRUE;
+    return TRUE;
+}
+
+void trace_close(void)
+{
+    if (!TRACE_RECORDING)
+        return;
+    TRACE_RECORDING = FALSE;
+
+    if (SINK.fill > 0)
+        publish();
+    pthread_mutex_lock(&SINK.lock);
+    SINK.stop = TRUE;
+    pthread_cond_signal(&SINK.ready);
+    pthread_mutex_unlock(&SINK.lock);
+    pthread_join(SINK.writer, NULL);
+
+    fclose(SINK.file);
+    free(SINK.ring);
+    SINK.file = NULL;
+    SINK.ring = NULL;
+}
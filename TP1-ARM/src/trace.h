@@ -0,0 +1,89 @@
+/*
+ * Traza de la ejecucion
+ *
+ * El nivel se elige en tiempo de ejecucion con el comando "trace n" y por
+ * defecto no se imprime nada. Compilando con -DSIM_TRACE=0 (make release)
+ * toda la traza desaparece del binario y TRACE() no cuesta ni la
+ * comparacion.
+ *
+ * Aparte de la traza de texto, "tracefile" graba cada instruccion como un
+ * registro binario de tamano fijo. Los registros se acumulan en un buffer
+ * circular de bloques que un thread escritor comprime (lz.h) y vuelca al
+ * archivo, asi el simulador no espera al disco. tracedump los vuelve a
+ * imprimir en el formato de texto.
+ *
+ * Formato del archivo: trace_file_header_t y despues, por cada bloque,
+ * dos uint32 (bytes sin comprimir, bytes guardados) seguidos de los datos;
+ * si ambos largos coinciden el bloque esta guardado sin comprimir.
+ */
+
+#ifndef _SIM_TRACE_H_
+#define _SIM_TRACE_H_
+
+#include <stdio.h>
+#include "shell.h"
+
+#ifndef SIM_TRACE
+#define SIM_TRACE 1
+#endif
+
+#define TRACE_OFF  0    // nada por instruccion
+#define TRACE_INST 1    // PC, palabra y opcode de cada instruccion
+#define TRACE_EXEC 2    // ademas el detalle de B.cond, LSL y LSR
+
+extern int TRACE_LEVEL;
+extern int TRACE_RECORDING;     // hay un tracefile abierto
+
+#if SIM_TRACE
+#define TRACE_ON(level) (TRACE_LEVEL >= (level))
+#define TRACE_RECORD_ON() TRACE_RECORDING
+#else
+#define TRACE_ON(level) 0
+#define TRACE_RECORD_ON() 0
+#endif
+
+#define TRACE(level, ...) \
+    do { if (TRACE_ON(level)) printf(__VA_ARGS__); } while (0)
+
+#define TRACE_NO_REG    0xFF    // la instruccion no escribe registro
+#define TRACE_FLAG_N    0x1
+#define TRACE_FLAG_Z    0x2
+#define TRACE_MEM_LOAD  1
+#define TRACE_MEM_STORE 2
+
+typedef struct {
+    uint64_t pc;
+    uint32_t instruction;
+    uint8_t rd;             // registro escrito, o TRACE_NO_REG
+    uint8_t flags;          // TRACE_FLAG_* despues de ejecutar
+    uint8_t mem;            // TRACE_MEM_*, 0 si no accede a memoria
+    uint8_t mem_size;       // bytes accedidos
+    uint64_t value;         // nuevo valor de rd
+    uint64_t mem_addr;
+    uint64_t mem_value;     // valor leido o escrito
+} trace_record_t;
+
+#define TRACE_MAGIC   "ARMTRACE"
+#define TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   // sizeof(trace_record_t)
+} trace_file_header_t;
+
+/* Linea de TRACE_INST para la instruccion en pc */
+void trace_instruction(uint64_t pc, uint32_t instruction);
+
+/* Linea con el efecto de un registro (tracedump -v) */
+void trace_effect(const trace_record_t *r);
+
+/* Empieza a grabar en filename; devuelve FALSE si no se pudo */
+int trace_open(const char *filename, int compress);
+
+/* Vuelca lo pendiente y cierra el archivo (no hace nada si no hay) */
+void trace_close(void);
+
+void trace_write(const trace_record_t *r);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * tracedump: imprime un archivo grabado con "tracefile" en el mismo
+ * formato que la traza de texto (trace 1). Con -v agrega una linea con
+ * los flags, el registro escrito y el acceso a memoria de cada registro.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include "lz.h"
+
+#define MAX_BLOCK_BYTES (1 << 24)
+
+int main(int argc, char *argv[])
+{
+    trace_file_header_t header;
+    uint32_t sizes[2];
+    uint8_t *packed, *raw;
+    FILE *f;
+    size_t n, i;
+    int verbose = argc == 3 && strcmp(argv[1], "-v") == 0;
+
+    if (argc != 2 && !verbose) {
+        printf("Error: usage: %s [-v] <trace_file>\n", argv[0]);
+        exit(1);
+    }
+    f = fopen(argv[argc - 1], "rb");
+    if (f == NULL) {
+        printf("Error: Can't open trace file %s\n", argv[argc - 1]);
+        exit(-1);
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+            memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != TRACE_VERSION ||
+            header.record_size != sizeof(trace_record_t)) {
+        printf("Error: %s is not a version %d trace file\n", argv[argc - 1], TRACE_VERSION);
+        exit(-1);
+    }
+
+    packed = malloc(MAX_BLOCK_BYTES);
+    raw = malloc(MAX_BLOCK_BYTES);
+    while (fread(sizes, sizeof(sizes), 1, f) == 1) {
+        if (sizes[0] > MAX_BLOCK_BYTES || sizes[1] > sizes[0] ||
+                sizes[0] % sizeof(trace_record_t) != 0 ||
+                fread(packed, 1, sizes[1], f) != sizes[1]) {
+            printf("Error: Truncated trace file\n");
+            exit(-1);
+        }
+        if (sizes[1] == sizes[0]) {
+            memcpy(raw, packed, sizes[0]);
+            n = sizes[0];
+        } else {
+            n = lz_decompress(packed, sizes[1], raw, sizes[0]);
+        }
+        if (n != sizes[0]) {
+            printf("Error: Corrupt trace block\n");
+            exit(-1);
+        }
+
+        for (i = 0; i < n; i += sizeof(trace_record_t)) {
+            trace_record_t r;
+
+            memcpy(&r, raw + i, sizeof(r));
+            trace_instruction(r.pc, r.instruction);
+            if (verbose)
+                trace_effect(&r);
+        }
+    }
+
+    free(packed);
+    free(raw);
+    fclose(f);
+    return 0;
+}